@@ -0,0 +1,25 @@
+; ========================================================================
+;
+; Branch-dense microbenchmark: every iteration evaluates eight different
+; conditional jumps, a jcxz and a loop. Run with "-b N" to get jumps/second.
+;
+; ========================================================================
+
+bits 16
+
+mov cx, 2000
+loop_start:
+mov ax, cx
+sub ax, 1000
+jl skip
+jg skip
+skip:
+cmp ax, 0
+je $+2
+js $+2
+jb $+2
+jp $+2
+jo $+2
+jbe $+2
+jcxz $+2
+loop loop_start
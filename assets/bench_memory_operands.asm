@@ -0,0 +1,29 @@
+; ========================================================================
+;
+; Memory-operand microbenchmark: every iteration makes twelve memory
+; accesses through a mix of effective-address forms (base, base + index,
+; base + index + displacement, direct). Run with "-b N".
+;
+; ========================================================================
+
+bits 16
+
+mov bp, 1000
+mov bx, 3000
+mov si, 2
+mov di, 4
+mov cx, 2000
+loop_start:
+mov [bp], cx
+add [bp + si], cx
+mov ax, [bp + si]
+sub [bx + di + 8], ax
+mov dx, [bx + di + 8]
+add word [bp + di + 300], 3
+cmp word [bx + si], 7
+mov [si + 1000], dx
+add ax, [di + 1000]
+sub [bx], ax
+mov [2000], ax
+mov ax, [2000]
+loop loop_start
@@ -0,0 +1,27 @@
+; ========================================================================
+;
+; String-instruction microbenchmark: every frame clears a 64000 byte
+; buffer with rep stosw and then copies another 64000 byte buffer over it
+; with rep movsw. Compare "-b N" with and without --no-bulk-strings to see
+; the memcpy/memset path against element-by-element execution.
+;
+; ========================================================================
+
+bits 16
+
+mov ax, 0x2000
+mov es, ax
+mov ax, 0x3000
+mov ds, ax
+mov bx, 50
+frame:
+mov di, 0
+mov ax, 0x0f1e
+mov cx, 32000
+rep stosw
+mov si, 0
+mov di, 0
+mov cx, 32000
+rep movsw
+sub bx, 1
+jne frame
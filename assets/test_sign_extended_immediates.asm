@@ -0,0 +1,29 @@
+; ========================================================================
+;
+; Arithmetic with a sign-extended byte immediate (0x83, S=1 W=1), and
+; loads and stores through a negative 8-bit displacement. NASM picks those
+; encodings for every value in -128..127 below, so the byte has to be
+; sign-extended to get the right result. Run it with -p to check they
+; print negative, and simulate it to check the registers end as:
+;
+;   AX 0005, BX 03e8, CX ff86, DX 0007, SI 0080, DI 0005, flags S A C
+;
+; ========================================================================
+
+bits 16
+
+mov cx, 5
+add cx, -1
+sub cx, -2
+mov bx, 1000
+mov word [bx], 10
+add word [bx], -3
+sub word [bx + 2], -128
+cmp cx, -1
+mov dx, [bx]
+mov si, [bx + 2]
+adc cx, -1
+sbb cx, 127
+mov word [bx - 2], 5
+mov ax, [998]
+mov di, [bx - 2]
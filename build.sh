@@ -21,4 +21,4 @@ echo $TARGET
 echo $SETTINGS
 echo $SOURCE_FILES
 
-gcc $TARGET $SETTINGS $SOURCE_FILES
+gcc $TARGET $SETTINGS $SOURCE_FILES -pthread
@@ -0,0 +1,225 @@
+/*
+  Batch mode
+  ==========
+  The job list is split into one contiguous range per worker, so a worker that keeps to its own
+  queue walks neighbouring programs. A worker takes jobs from the front of its own range and, once
+  that is empty, steals the back half of the first other queue that still has work. Jobs are never
+  added after the workers start, so a worker that finds every queue empty is done.
+*/
+
+#define BATCH_MAX_THREADS 256
+
+static s32 PopBatchJob(batch_queue *Queue)
+{
+    s32 JobIndex = -1;
+    pthread_mutex_lock(&Queue->Lock);
+    if (Queue->Begin < Queue->End) JobIndex = Queue->Begin++;
+    pthread_mutex_unlock(&Queue->Lock);
+    return JobIndex;
+}
+
+static s32 StealBatchJobs(batch_worker *Worker)
+{
+    batch *Batch = Worker->Batch;
+    batch_queue *OwnQueue = &Batch->Queues[Worker->Index];
+    s32 I;
+    for (I = 1; I < Batch->WorkerCount; ++I)
+    {
+        batch_queue *Victim = &Batch->Queues[(Worker->Index + I) % Batch->WorkerCount];
+        s32 StolenBegin = 0, StolenEnd = 0;
+        pthread_mutex_lock(&Victim->Lock);
+        if (Victim->Begin < Victim->End)
+        {
+            // NOTE: the victim keeps the front half (it is working from the front), we take the rest
+            StolenBegin = Victim->Begin + (Victim->End - Victim->Begin) / 2;
+            StolenEnd = Victim->End;
+            Victim->End = StolenBegin;
+        }
+        pthread_mutex_unlock(&Victim->Lock);
+        if (StolenBegin < StolenEnd)
+        {
+            pthread_mutex_lock(&OwnQueue->Lock);
+            OwnQueue->Begin = StolenBegin;
+            OwnQueue->End = StolenEnd;
+            pthread_mutex_unlock(&OwnQueue->Lock);
+            Worker->JobsStolen += StolenEnd - StolenBegin;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static s32 LoadBatchProgram(sim_context *Context, char *FilePath, simulation_command_line_args *CommandLineArgs)
+{
+    memset(Context->Registers, 0, sizeof(Context->Registers));
+    Context->Flags = 0;
+    return LoadProgramFile(Context, FilePath, CommandLineArgs->LoadSegment, CommandLineArgs->LoadOffset);
+}
+
+static void RunBatchJob(sim_context *Context, batch *Batch, s32 JobIndex)
+{
+    batch_job *Job = &Batch->Jobs[JobIndex];
+    ThreadBatchJob = Job;
+    BatchJobPrint(Job, "; %s\n", Job->FilePath);
+    Job->Result = LoadBatchProgram(Context, Job->FilePath, Batch->CommandLineArgs);
+    if (!Job->Result) Job->Result = SimulateProgram(Context, Batch->CommandLineArgs, 0);
+    if (!Job->Result)
+    {
+        char Registers[512];
+        FormatRegisters(Context, Registers, sizeof(Registers));
+        BatchJobPrint(Job, "%s", Registers);
+        if (Batch->CommandLineArgs->DumpMemory)
+        {
+            char DumpPath[64];
+            snprintf(DumpPath, sizeof(DumpPath), "../dist/memory_dump_%05d.delta", JobIndex);
+            Job->Result = WriteMemoryDump(Context, DumpPath);
+            if (!Job->Result) BatchJobPrint(Job, "memory dump %s\n", DumpPath);
+        }
+    }
+    ThreadBatchJob = 0;
+}
+
+static void *BatchWorkerMain(void *Parameter)
+{
+    batch_worker *Worker = Parameter;
+    batch *Batch = Worker->Batch;
+    sim_context *Context = AllocateSimContext(Batch->CommandLineArgs->UseHugePages);
+    if (!Context)
+    {
+        printf("ERROR: batch worker %d could not allocate a simulation context\n", Worker->Index);
+        return 0;
+    }
+    for (;;)
+    {
+        s32 JobIndex = PopBatchJob(&Batch->Queues[Worker->Index]);
+        if (JobIndex < 0)
+        {
+            if (!StealBatchJobs(Worker)) break;
+            continue;
+        }
+        RunBatchJob(Context, Batch, JobIndex);
+        Worker->JobsRun += 1;
+    }
+    FreeSimContext(Context);
+    return 0;
+}
+
+// NOTE: one path per line, blank lines and lines starting with '#' are skipped. The result is one allocation like ListDirectoryFiles.
+static char **ReadBatchManifest(char *ManifestPath, s32 *FileCount)
+{
+    FILE *File = fopen(ManifestPath, "rb");
+    char *Text, *Line, **Paths;
+    s32 TextSize, Count = 0, I;
+    if (!File)
+    {
+        printf("Could not open batch manifest %s\n", ManifestPath);
+        return 0;
+    }
+    fseek(File, 0, SEEK_END);
+    TextSize = ftell(File);
+    if (TextSize < 0)
+    {
+        printf("Could not read batch manifest %s\n", ManifestPath);
+        fclose(File);
+        return 0;
+    }
+    fseek(File, 0, SEEK_SET);
+    // NOTE: every line needs at most one pointer, so sizing for TextSize + 1 lines is always enough
+    Paths = malloc((TextSize + 1) * sizeof(char *) + TextSize + 1);
+    if (!Paths)
+    {
+        fclose(File);
+        return 0;
+    }
+    Text = (char *)(Paths + TextSize + 1);
+    TextSize = fread(Text, 1, TextSize, File);
+    Text[TextSize] = 0;
+    fclose(File);
+    Line = Text;
+    for (I = 0; I <= TextSize; ++I)
+    {
+        if (Text[I] == '\n' || Text[I] == '\r' || Text[I] == 0)
+        {
+            Text[I] = 0;
+            if (Line[0] && Line[0] != '#') Paths[Count++] = Line;
+            Line = Text + I + 1;
+        }
+    }
+    *FileCount = Count;
+    return Paths;
+}
+
+static s32 RunBatch(simulation_command_line_args *CommandLineArgs)
+{
+    batch Batch = {0};
+    s32 I, FileCount = 0, FailedCount = 0, Result = 0;
+    u64 JobsStolen = 0;
+    f64 StartSeconds, ElapsedSeconds;
+    char **FilePaths = IsDirectory(CommandLineArgs->BatchPath) ? ListDirectoryFiles(CommandLineArgs->BatchPath, &FileCount) : ReadBatchManifest(CommandLineArgs->BatchPath, &FileCount);
+    if (!FilePaths) return ErrorMessageAndCode("Could not read the batch program list\n", 1);
+
+    Batch.CommandLineArgs = CommandLineArgs;
+    Batch.JobCount = FileCount;
+    Batch.WorkerCount = CommandLineArgs->ThreadCount > 0 ? CommandLineArgs->ThreadCount : GetProcessorCount();
+    if (Batch.WorkerCount > BATCH_MAX_THREADS) Batch.WorkerCount = BATCH_MAX_THREADS;
+    Batch.Jobs = calloc(FileCount ? FileCount : 1, sizeof(batch_job));
+    Batch.Queues = calloc(Batch.WorkerCount, sizeof(batch_queue));
+    Batch.Workers = calloc(Batch.WorkerCount, sizeof(batch_worker));
+    if (!Batch.Jobs || !Batch.Queues || !Batch.Workers)
+    {
+        free(Batch.Workers);
+        free(Batch.Queues);
+        free(Batch.Jobs);
+        free(FilePaths);
+        return ErrorMessageAndCode("Could not allocate the batch\n", 1);
+    }
+    for (I = 0; I < FileCount; ++I)
+    {
+        Batch.Jobs[I].FilePath = FilePaths[I];
+        // NOTE: stays set if no worker ever gets to the job
+        Batch.Jobs[I].Result = -1;
+    }
+    for (I = 0; I < Batch.WorkerCount; ++I)
+    {
+        pthread_mutex_init(&Batch.Queues[I].Lock, 0);
+        Batch.Queues[I].Begin = (s32)((u64)FileCount * I / Batch.WorkerCount);
+        Batch.Queues[I].End = (s32)((u64)FileCount * (I + 1) / Batch.WorkerCount);
+        Batch.Workers[I].Index = I;
+        Batch.Workers[I].Batch = &Batch;
+    }
+
+    StartSeconds = GetWallClockSeconds();
+    for (I = 0; I < Batch.WorkerCount; ++I)
+    {
+        Batch.Workers[I].IsRunning = !pthread_create(&Batch.Workers[I].Thread, 0, BatchWorkerMain, &Batch.Workers[I]);
+        // NOTE: the jobs of a worker that never started get stolen by the others
+        if (!Batch.Workers[I].IsRunning) printf("ERROR: could not start batch worker %d\n", I);
+    }
+    for (I = 0; I < Batch.WorkerCount; ++I)
+    {
+        if (Batch.Workers[I].IsRunning) pthread_join(Batch.Workers[I].Thread, 0);
+        JobsStolen += Batch.Workers[I].JobsStolen;
+    }
+    ElapsedSeconds = GetWallClockSeconds() - StartSeconds;
+
+    for (I = 0; I < FileCount; ++I)
+    {
+        batch_job *Job = &Batch.Jobs[I];
+        if (Job->OutputHasFailed) printf("; %s\nERROR: could not hold the program's output\n", Job->FilePath);
+        else if (!Job->OutputUsed) printf("; %s\nERROR: program was not run\n", Job->FilePath);
+        if (Job->OutputUsed) fwrite(Job->Output, 1, Job->OutputUsed, stdout);
+        if (Job->Result) FailedCount += 1;
+        free(Job->Output);
+    }
+    printf("\nBatch: %d programs, %d failed, %d threads, %.3f seconds, %.1f programs/second, %llu jobs stolen\n",
+           FileCount, FailedCount, Batch.WorkerCount, ElapsedSeconds,
+           ElapsedSeconds > 0 ? (f64)FileCount / ElapsedSeconds : 0.0, (unsigned long long)JobsStolen);
+    if (FailedCount) Result = 1;
+
+    for (I = 0; I < Batch.WorkerCount; ++I) pthread_mutex_destroy(&Batch.Queues[I].Lock);
+    free(Batch.Workers);
+    free(Batch.Queues);
+    free(Batch.Jobs);
+    free(FilePaths);
+    return Result;
+}
@@ -0,0 +1,48 @@
+/*
+  Batch mode runs a list of programs on a pool of worker threads. Every worker owns a sim_context and
+  a queue of job indices; a worker whose queue runs dry steals half of another worker's remaining jobs.
+*/
+// NOTE: a job's output starts this big and doubles whenever a print does not fit
+#define BATCH_OUTPUT_SIZE 1024
+
+typedef struct
+{
+    char *FilePath;
+    s32 Result;
+    // NOTE: everything this program printed, written out in input order once the batch is done
+    char *Output;
+    s32 OutputSize;
+    s32 OutputUsed;
+    // NOTE: set when Output could not grow, what the job printed is dropped and reported instead
+    s32 OutputHasFailed;
+} batch_job;
+
+// NOTE: the job indices [Begin, End) still waiting in one worker's queue
+typedef struct
+{
+    pthread_mutex_t Lock;
+    s32 Begin;
+    s32 End;
+} batch_queue;
+
+typedef struct batch batch;
+
+typedef struct
+{
+    s32 Index;
+    batch *Batch;
+    pthread_t Thread;
+    s32 IsRunning;
+    u64 JobsRun;
+    u64 JobsStolen;
+} batch_worker;
+
+struct batch
+{
+    batch_job *Jobs;
+    s32 JobCount;
+    batch_queue *Queues;
+    batch_worker *Workers;
+    s32 WorkerCount;
+    simulation_command_line_args *CommandLineArgs;
+};
@@ -0,0 +1,257 @@
+/*
+  x86-64 JIT for hot translated blocks.
+
+  Only blocks made entirely of 16-bit register/immediate mov, add, sub and cmp (optionally ending
+  in a conditional jump) are compiled; everything else stays in the interpreter. Guest registers stay in
+  the context's Registers and are accessed as memory operands off the first argument, so the compiled code
+  never has to spill or reload guest state around a fallback.
+
+  Compiled blocks are called as (Registers = rdi, Flags = rsi, FlagsFromHostFlags = rdx) and
+  use rax, rcx, rdx, r9 and r10 as scratch.
+*/
+
+#define JIT_CODE_BUFFER_SIZE (1024 * 1024)
+#define JIT_THRESHOLD 16
+// NOTE: the largest block we can emit is MAX_BLOCK_LENGTH instructions of at most JIT_MAX_INSTRUCTION_SIZE bytes plus the exit
+#define JIT_MAX_INSTRUCTION_SIZE 64
+// NOTE: the compiled code must leave every other flag alone
+#define JIT_UPDATED_FLAGS ARITHMETIC_FLAGS
+
+#define HOST_FLAG_CARRY 0x01
+#define HOST_FLAG_PARITY 0x04
+#define HOST_FLAG_AUX_CARRY 0x10
+#define HOST_FLAG_ZERO 0x40
+#define HOST_FLAG_SIGN 0x80
+
+u8 GlobalJitFlagsFromHostFlags[256];
+
+// NOTE: filled once by InitSimulatorTables, only read after that
+static void InitJitTables(void)
+{
+    s32 HostFlags;
+    for (HostFlags = 0; HostFlags < 256; ++HostFlags)
+    {
+        u8 GuestFlags = 0;
+        if (HostFlags & HOST_FLAG_CARRY) GuestFlags |= flag_Carry;
+        if (HostFlags & HOST_FLAG_PARITY) GuestFlags |= flag_Parity;
+        if (HostFlags & HOST_FLAG_AUX_CARRY) GuestFlags |= flag_Aux_Carry;
+        if (HostFlags & HOST_FLAG_ZERO) GuestFlags |= flag_Zero;
+        if (HostFlags & HOST_FLAG_SIGN) GuestFlags |= flag_Sign;
+        GlobalJitFlagsFromHostFlags[HostFlags] = GuestFlags & JIT_UPDATED_FLAGS;
+    }
+}
+
+static s32 InitJit(sim_context *Context)
+{
+    if (!Context->JitCode.Code)
+    {
+        Context->JitCode.Code = AllocateExecutableMemory(JIT_CODE_BUFFER_SIZE);
+        if (!Context->JitCode.Code) return 1;
+        Context->JitCode.Size = JIT_CODE_BUFFER_SIZE;
+    }
+    Context->JitCode.Used = 0;
+    memset(&Context->JitStats, 0, sizeof(Context->JitStats));
+    return 0;
+}
+
+static void ResetJitCode(jit_code_buffer *Code)
+{
+    // NOTE: only called together with a block cache flush, so no block still points into the buffer
+    Code->Used = 0;
+}
+
+static void JitEmit8(jit_code_buffer *Code, u8 Byte)
+{
+    Code->Code[Code->Used++] = Byte;
+}
+
+static void JitEmit16(jit_code_buffer *Code, u16 Value)
+{
+    JitEmit8(Code, Value & 0xff);
+    JitEmit8(Code, (Value >> 8) & 0xff);
+}
+
+static void JitEmit32(jit_code_buffer *Code, u32 Value)
+{
+    JitEmit16(Code, Value & 0xffff);
+    JitEmit16(Code, (Value >> 16) & 0xffff);
+}
+
+static u32 JitRegisterOffset(s16 RegisterName)
+{
+    return RegisterIndexTable[RegisterName] * sizeof(u16);
+}
+
+// NOTE: segment registers are left to the interpreter, writing one has to update the cached segment bases
+static s32 JitIsWideRegister(s16 RegisterName)
+{
+    switch(RegisterName)
+    {
+    case AX: case BX: case CX: case DX:
+    case SP: case BP: case SI: case DI:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+static s32 JitIsSupportedKind(instruction_kind Kind)
+{
+    return Kind == instruction_kind_Mov || Kind == instruction_kind_Add || Kind == instruction_kind_Sub || Kind == instruction_kind_Cmp;
+}
+
+static s32 JitCanCompileInstruction(decoded_instruction *Instruction, s32 IsLastInstruction)
+{
+    switch(Instruction->Op)
+    {
+    case simulate_op_RegisterToRegister:
+        return JitIsSupportedKind(Instruction->Opcode.InstructionKind) &&
+            JitIsWideRegister(Instruction->DestinationRegister) && JitIsWideRegister(Instruction->SourceRegister);
+    case simulate_op_ImmediateToRegisterMemory:
+    case simulate_op_ImmediateToRegister:
+        return JitIsSupportedKind(Instruction->Opcode.InstructionKind) && JitIsWideRegister(Instruction->DestinationRegister);
+    case simulate_op_Jump:
+        return IsLastInstruction;
+    default:
+        return 0;
+    }
+}
+
+// movzx eax, word [rdi + Offset]
+static void JitEmitLoadAx(jit_code_buffer *Code, u32 Offset)
+{
+    JitEmit8(Code, 0x0f); JitEmit8(Code, 0xb7); JitEmit8(Code, 0x87); JitEmit32(Code, Offset);
+}
+
+// mov word [rdi + Offset], ax
+static void JitEmitStoreAx(jit_code_buffer *Code, u32 Offset)
+{
+    JitEmit8(Code, 0x66); JitEmit8(Code, 0x89); JitEmit8(Code, 0x87); JitEmit32(Code, Offset);
+}
+
+// NOTE: ModRMOpcode is the "op ax, r/m16" opcode byte (add 03, sub 2b, cmp 3b)
+static void JitEmitAluAxRegister(jit_code_buffer *Code, u8 ModRMOpcode, u32 Offset)
+{
+    JitEmit8(Code, 0x66); JitEmit8(Code, ModRMOpcode); JitEmit8(Code, 0x87); JitEmit32(Code, Offset);
+}
+
+// NOTE: AccumulatorOpcode is the "op ax, imm16" opcode byte (add 05, sub 2d, cmp 3d, mov b8)
+static void JitEmitAluAxImmediate(jit_code_buffer *Code, u8 AccumulatorOpcode, u16 Immediate)
+{
+    JitEmit8(Code, 0x66); JitEmit8(Code, AccumulatorOpcode); JitEmit16(Code, Immediate);
+}
+
+static u8 JitFlagShift(flag Flag)
+{
+    u8 Shift = 0;
+    while (!(Flag & (1 << Shift))) ++Shift;
+    return Shift;
+}
+
+static void JitEmitCaptureFlags(jit_code_buffer *Code)
+{
+    JitEmit8(Code, 0x9f);                                                 // lahf
+    JitEmit8(Code, 0x0f); JitEmit8(Code, 0xb6); JitEmit8(Code, 0xcc);                 // movzx ecx, ah
+    JitEmit8(Code, 0x41); JitEmit8(Code, 0x0f); JitEmit8(Code, 0xb6); JitEmit8(Code, 0x0c); JitEmit8(Code, 0x09); // movzx ecx, byte [r9 + rcx]
+    // NOTE: LAHF does not carry OF, so it is read separately
+    JitEmit8(Code, 0x0f); JitEmit8(Code, 0x90); JitEmit8(Code, 0xc2);                 // seto dl
+    JitEmit8(Code, 0x0f); JitEmit8(Code, 0xb6); JitEmit8(Code, 0xd2);                 // movzx edx, dl
+    JitEmit8(Code, 0xc1); JitEmit8(Code, 0xe2); JitEmit8(Code, JitFlagShift(flag_Overflow)); // shl edx, log2(flag_Overflow)
+    JitEmit8(Code, 0x09); JitEmit8(Code, 0xd1);                                 // or ecx, edx
+    JitEmit8(Code, 0x44); JitEmit8(Code, 0x0f); JitEmit8(Code, 0xb7); JitEmit8(Code, 0x16); // movzx r10d, word [rsi]
+    JitEmit8(Code, 0x41); JitEmit8(Code, 0x81); JitEmit8(Code, 0xe2); JitEmit32(Code, ~(u32)JIT_UPDATED_FLAGS); // and r10d, ~JIT_UPDATED_FLAGS
+    JitEmit8(Code, 0x41); JitEmit8(Code, 0x09); JitEmit8(Code, 0xca);                 // or r10d, ecx
+    JitEmit8(Code, 0x66); JitEmit8(Code, 0x44); JitEmit8(Code, 0x89); JitEmit8(Code, 0x16); // mov word [rsi], r10w
+}
+
+static void JitEmitArithmetic(jit_code_buffer *Code, instruction_kind Kind, s16 DestinationRegister, s32 IsImmediate, s16 SourceRegister, u16 Immediate)
+{
+    u32 DestinationOffset = JitRegisterOffset(DestinationRegister);
+    if (Kind == instruction_kind_Mov)
+    {
+        if (IsImmediate) JitEmitAluAxImmediate(Code, 0xb8, Immediate);
+        else JitEmitLoadAx(Code, JitRegisterOffset(SourceRegister));
+        JitEmitStoreAx(Code, DestinationOffset);
+        return;
+    }
+    JitEmitLoadAx(Code, DestinationOffset);
+    switch(Kind)
+    {
+    case instruction_kind_Add:
+        if (IsImmediate) JitEmitAluAxImmediate(Code, 0x05, Immediate);
+        else JitEmitAluAxRegister(Code, 0x03, JitRegisterOffset(SourceRegister));
+        break;
+    case instruction_kind_Sub:
+        if (IsImmediate) JitEmitAluAxImmediate(Code, 0x2d, Immediate);
+        else JitEmitAluAxRegister(Code, 0x2b, JitRegisterOffset(SourceRegister));
+        break;
+    default:
+        if (IsImmediate) JitEmitAluAxImmediate(Code, 0x3d, Immediate);
+        else JitEmitAluAxRegister(Code, 0x3b, JitRegisterOffset(SourceRegister));
+        break;
+    }
+    // NOTE: mov does not touch the host flags, so the store can go before LAHF overwrites AH
+    if (Kind != instruction_kind_Cmp) JitEmitStoreAx(Code, DestinationOffset);
+    JitEmitCaptureFlags(Code);
+}
+
+static jit_block_function *JitCompileBlock(jit_code_buffer *Code, translated_block *Block)
+{
+#if defined(__x86_64__)
+    s32 I;
+    u8 *Entry;
+    u16 FallThroughIP = Block->StartIP + Block->ByteLength;
+    decoded_instruction *LastInstruction = Block->Instructions + Block->InstructionCount - 1;
+    if (!Code->Code) return 0;
+    for (I = 0; I < Block->InstructionCount; ++I)
+    {
+        if (!JitCanCompileInstruction(Block->Instructions + I, I == Block->InstructionCount - 1)) return 0;
+    }
+    if (Code->Used + (Block->InstructionCount + 1) * JIT_MAX_INSTRUCTION_SIZE > Code->Size) return 0;
+    if (ProtectExecutableMemory(Code->Code, Code->Size, 0)) return 0;
+    Code->IsExecutable = 0;
+
+    Entry = Code->Code + Code->Used;
+    JitEmit8(Code, 0x49); JitEmit8(Code, 0x89); JitEmit8(Code, 0xd1); // mov r9, rdx
+    for (I = 0; I < Block->InstructionCount; ++I)
+    {
+        decoded_instruction *Instruction = Block->Instructions + I;
+        switch(Instruction->Op)
+        {
+        case simulate_op_RegisterToRegister:
+            JitEmitArithmetic(Code, Instruction->Opcode.InstructionKind, Instruction->DestinationRegister, 0, Instruction->SourceRegister, 0);
+            break;
+        case simulate_op_ImmediateToRegisterMemory:
+        case simulate_op_ImmediateToRegister:
+            JitEmitArithmetic(Code, Instruction->Opcode.InstructionKind, Instruction->DestinationRegister, 1, 0, Instruction->Immediate);
+            break;
+        default:
+            break;
+        }
+    }
+
+    JitEmitAluAxImmediate(Code, 0xb8, FallThroughIP); // mov ax, FallThroughIP
+    if (LastInstruction->Op == simulate_op_Jump)
+    {
+        u16 TargetIP = FallThroughIP + (s8)LastInstruction->Immediate;
+        u64 Condition = JumpConditionTable[LastInstruction->FirstByte & 0xf];
+        // NOTE: the same lookup SimulateJump does, the condition's bit for the current flags ends up in CF
+        JitEmit8(Code, 0x0f); JitEmit8(Code, 0xb7); JitEmit8(Code, 0x0e);                         // movzx ecx, word [rsi]
+        JitEmit8(Code, 0x83); JitEmit8(Code, 0xe1); JitEmit8(Code, JUMP_CONDITION_FLAGS);          // and ecx, JUMP_CONDITION_FLAGS
+        JitEmit8(Code, 0x48); JitEmit8(Code, 0xba); JitEmit32(Code, Condition & 0xffffffff); JitEmit32(Code, Condition >> 32); // mov rdx, Condition
+        JitEmit8(Code, 0x48); JitEmit8(Code, 0x0f); JitEmit8(Code, 0xa3); JitEmit8(Code, 0xca);         // bt rdx, rcx
+        JitEmit8(Code, 0x66); JitEmit8(Code, 0xb9); JitEmit16(Code, TargetIP);                   // mov cx, TargetIP
+        JitEmit8(Code, 0x66); JitEmit8(Code, 0x0f); JitEmit8(Code, 0x42); JitEmit8(Code, 0xc1);         // cmovc ax, cx
+    }
+    JitEmitStoreAx(Code, JitRegisterOffset(IP));
+    JitEmit8(Code, 0xc3); // ret
+    // NOTE: if the buffer cannot be made executable again no compiled block runs until a later compile manages it
+    if (ProtectExecutableMemory(Code->Code, Code->Size, 1)) return 0;
+    Code->IsExecutable = 1;
+    return (jit_block_function *)Entry;
+#else
+    // NOTE: no backend for this host, every block stays in the interpreter
+    (void)Block;
+    return 0;
+#endif
+}
@@ -0,0 +1,29 @@
+/*
+  The JIT compiles hot translated blocks to x86-64. A compiled block is called with pointers to the
+  context's registers and flags and a table that maps the host flags (as loaded by LAHF) onto guest flag bits.
+*/
+typedef void jit_block_function(u16 *Registers, u16 *Flags, u8 *FlagsFromHostFlags);
+
+typedef enum
+{
+    jit_state_Cold,
+    jit_state_Compiled,
+    jit_state_Unsupported,
+} jit_state;
+
+typedef struct
+{
+    u8 *Code;
+    s32 Size;
+    s32 Used;
+    // NOTE: the buffer is writable while a block is emitted and executable otherwise, compiled blocks only run while this is set
+    s32 IsExecutable;
+} jit_code_buffer;
+
+typedef struct
+{
+    u64 BlocksCompiled;
+    u64 BlocksUnsupported;
+    u64 CompiledBlocksExecuted;
+    u64 BlocksVerified;
+} jit_stats;
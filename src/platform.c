@@ -1,33 +1,386 @@
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
 #include "platform.h"
 
-static buffer *AllocateBuffer(s32 Size)
+/*
+  Maps a whole file read-only instead of reading it into a heap buffer. An empty file maps to
+  Data = 0, Size = 0. Returns non-zero if the file is missing or cannot be mapped.
+*/
+static s32 MapFile(char *FilePath, mapped_file *MappedFile)
+{
+    struct stat Stat;
+    s32 File = open(FilePath, O_RDONLY);
+    MappedFile->Data = 0;
+    MappedFile->Size = 0;
+    if (File < 0)
+    {
+        PrintMessage("File not found %s\n", FilePath);
+        return 1;
+    }
+    if (fstat(File, &Stat) || Stat.st_size > 0x7fffffff)
+    {
+        PrintMessage("Could not map file %s\n", FilePath);
+        close(File);
+        return 1;
+    }
+    if (Stat.st_size > 0)
+    {
+        void *Data = mmap(0, Stat.st_size, PROT_READ, MAP_PRIVATE, File, 0);
+        if (Data == MAP_FAILED)
+        {
+            PrintMessage("Could not map file %s\n", FilePath);
+            close(File);
+            return 1;
+        }
+        MappedFile->Data = Data;
+        MappedFile->Size = (s32)Stat.st_size;
+    }
+    // NOTE: the mapping stays valid after the descriptor is closed
+    close(File);
+    return 0;
+}
+
+static void UnmapFile(mapped_file *MappedFile)
+{
+    if (MappedFile->Data) munmap(MappedFile->Data, MappedFile->Size);
+    MappedFile->Data = 0;
+    MappedFile->Size = 0;
+}
+
+/*
+  Reads a whole file straight into Memory without a heap buffer in between. Files from
+  READ_FILE_MAP_THRESHOLD bytes up are mapped and copied; smaller files are cheaper to read()
+  than to map and unmap. Returns non-zero if the file is missing or larger than MaxSize.
+*/
+#define READ_FILE_MAP_THRESHOLD (64 * 1024)
+
+static s32 ReadFileIntoMemory(char *FilePath, u8 *Memory, s32 MaxSize, s32 *FileSize)
+{
+    struct stat Stat;
+    s32 Result = 0;
+    s32 File = open(FilePath, O_RDONLY);
+    *FileSize = 0;
+    if (File < 0)
+    {
+        PrintMessage("File not found %s\n", FilePath);
+        return 1;
+    }
+    if (fstat(File, &Stat) || Stat.st_size > MaxSize)
+    {
+        PrintMessage("File %s is larger than the %d bytes it has to fit in\n", FilePath, MaxSize);
+        close(File);
+        return 1;
+    }
+    if (Stat.st_size >= READ_FILE_MAP_THRESHOLD)
+    {
+        void *Data = mmap(0, Stat.st_size, PROT_READ, MAP_PRIVATE, File, 0);
+        if (Data == MAP_FAILED) Result = 1;
+        else
+        {
+            memcpy(Memory, Data, Stat.st_size);
+            munmap(Data, Stat.st_size);
+            *FileSize = (s32)Stat.st_size;
+        }
+    }
+    else
+    {
+        while (*FileSize < Stat.st_size)
+        {
+            ssize_t Read = read(File, Memory + *FileSize, Stat.st_size - *FileSize);
+            if (Read <= 0) break;
+            *FileSize += Read;
+        }
+        if (*FileSize != Stat.st_size) Result = 1;
+    }
+    if (Result) PrintMessage("Could not read file %s\n", FilePath);
+    close(File);
+    return Result;
+}
+
+static f64 GetWallClockSeconds(void)
+{
+    struct timespec Time;
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (f64)Time.tv_sec + (f64)Time.tv_nsec / 1000000000.0;
+}
+
+// NOTE: the memory comes back writable, ProtectExecutableMemory flips it to executable once code is in it
+static u8 *AllocateExecutableMemory(s32 Size)
+{
+    void *Memory = mmap(0, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Memory == MAP_FAILED)
+    {
+        PrintMessage("Could not map %d bytes of executable memory\n", Size);
+        return 0;
+    }
+    return Memory;
+}
+
+// NOTE: the memory is either writable or executable, never both
+static s32 ProtectExecutableMemory(u8 *Memory, s32 Size, s32 IsExecutable)
+{
+    s32 Protection = IsExecutable ? PROT_READ | PROT_EXEC : PROT_READ | PROT_WRITE;
+    if (mprotect(Memory, Size, Protection))
+    {
+        PrintMessage("Could not change the protection of %d bytes of executable memory\n", Size);
+        return 1;
+    }
+    return 0;
+}
+
+// NOTE: the pages come back zeroed
+static void *AllocateMemory(u64 Size)
+{
+    void *Memory = mmap(0, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (Memory == MAP_FAILED)
+    {
+        PrintMessage("Could not map %llu bytes of memory\n", (unsigned long long)Size);
+        return 0;
+    }
+    return Memory;
+}
+
+/*
+  Maps Size zeroed bytes followed by an inaccessible guard page, so running off the end faults instead
+  of reading or corrupting whatever happens to be mapped next. With UseHugePages the usable part is
+  rounded up to a 2 MiB aligned block and marked for transparent huge pages. *ArenaSize receives the
+  size to pass to FreeMemory.
+*/
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// NOTE: every batch worker allocates its own arena, the huge page fallback is only reported for the first one
+static pthread_once_t ReportNoHugePagesOnce = PTHREAD_ONCE_INIT;
+
+static void ReportNoHugePages(void)
+{
+    PrintMessage("Transparent huge pages are not available, using normal pages\n");
+}
+
+static u8 *AllocateGuardedMemory(u64 Size, s32 UseHugePages, u64 *ArenaSize)
+{
+    u64 PageSize = sysconf(_SC_PAGESIZE);
+    u64 Alignment = UseHugePages ? HUGE_PAGE_SIZE : PageSize;
+    u64 UsableSize = (Size + Alignment - 1) & ~(Alignment - 1);
+    // NOTE: over-reserve so an aligned block plus the guard page always fits, then trim both ends
+    u64 ReservedSize = UsableSize + PageSize + (Alignment - PageSize);
+    u8 *Reserved = mmap(0, ReservedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u8 *Memory, *End;
+    if (Reserved == MAP_FAILED)
+    {
+        PrintMessage("Could not map %llu bytes of memory\n", (unsigned long long)ReservedSize);
+        return 0;
+    }
+    Memory = (u8 *)(((u64)Reserved + Alignment - 1) & ~(Alignment - 1));
+    End = Memory + UsableSize + PageSize;
+    if (Memory > Reserved) munmap(Reserved, Memory - Reserved);
+    if (Reserved + ReservedSize > End) munmap(End, Reserved + ReservedSize - End);
+    if (mprotect(Memory + UsableSize, PageSize, PROT_NONE))
+    {
+        PrintMessage("Could not protect the guard page\n");
+        munmap(Memory, UsableSize + PageSize);
+        return 0;
+    }
+    if (UseHugePages && madvise(Memory, UsableSize, MADV_HUGEPAGE))
+    {
+        pthread_once(&ReportNoHugePagesOnce, ReportNoHugePages);
+    }
+    *ArenaSize = UsableSize + PageSize;
+    return Memory;
+}
+
+static void FreeMemory(void *Memory, u64 Size)
+{
+    if (Memory) munmap(Memory, Size);
+}
+
+/*
+  Shared memory files back copy-on-write memory: every MapCopyOnWrite of the same file starts out
+  sharing the file's pages, and the kernel copies a page the first time one of the mappings writes to it.
+*/
+static s32 CreateSharedMemoryFile(u64 Size)
+{
+    s32 File = (s32)syscall(SYS_memfd_create, "8086-snapshot", 0);
+    if (File < 0)
+    {
+        PrintMessage("Could not create a shared memory file\n");
+        return -1;
+    }
+    // NOTE: the file reads as zero everywhere until something is written to it
+    if (ftruncate(File, Size))
+    {
+        PrintMessage("Could not size a shared memory file to %llu bytes\n", (unsigned long long)Size);
+        close(File);
+        return -1;
+    }
+    return File;
+}
+
+// NOTE: keeps reading until Size bytes are in or the file ends, returns the byte count or -1 on an error
+static s64 ReadFileBytes(s32 File, void *Data, u64 Size)
+{
+    u8 *Bytes = Data;
+    u64 Total = 0;
+    while (Total < Size)
+    {
+        ssize_t Read = read(File, Bytes + Total, Size - Total);
+        if (Read < 0) return -1;
+        if (Read == 0) break;
+        Total += Read;
+    }
+    return (s64)Total;
+}
+
+// NOTE: like ReadFileBytes, but reads at Offset and leaves the file position alone, so threads can share the descriptor
+static s64 ReadFileBytesAt(s32 File, void *Data, u64 Size, u64 Offset)
 {
-    buffer *Buffer = malloc(BUFFER_ALLOC_SIZE(Size));
-    Buffer->Size = Size;
-    Buffer->Data = (u8 *)(Buffer + sizeof(buffer));
-    return Buffer;
+    u8 *Bytes = Data;
+    u64 Total = 0;
+    while (Total < Size)
+    {
+        ssize_t Read = pread(File, Bytes + Total, Size - Total, Offset + Total);
+        if (Read < 0) return -1;
+        if (Read == 0) break;
+        Total += Read;
+    }
+    return (s64)Total;
 }
 
-static void FreeBuffer(buffer *Buffer)
+// NOTE: returns non-zero for pipes, terminals and anything else that cannot be read at an offset
+static s32 GetRegularFileSize(s32 File, u64 *Size)
 {
-    free(Buffer);
+    struct stat Stat;
+    if (fstat(File, &Stat) || !S_ISREG(Stat.st_mode)) return 1;
+    *Size = (u64)Stat.st_size;
+    return 0;
 }
 
-static buffer *ReadFileIntoBuffer(char *FilePath)
+// NOTE: write can stop short on pipes and terminals, so it is called until every byte is out
+static s32 WriteFileBytes(s32 File, void *Data, u64 Size)
 {
-    s32 FileSize;
-    buffer *Buffer;
-    FILE *File = fopen(FilePath, "rb");
-    if(!File)
+    u8 *Bytes = Data;
+    while (Size)
     {
-        printf("File not found\n");
+        ssize_t Written = write(File, Bytes, Size);
+        if (Written <= 0) return 1;
+        Bytes += Written;
+        Size -= Written;
+    }
+    return 0;
+}
+
+static s32 WriteSharedMemoryFile(s32 File, u64 Offset, void *Data, u64 Size)
+{
+    u8 *Bytes = Data;
+    while (Size)
+    {
+        ssize_t Written = pwrite(File, Bytes, Size, Offset);
+        if (Written <= 0) return 1;
+        Bytes += Written;
+        Offset += Written;
+        Size -= Written;
+    }
+    return 0;
+}
+
+// NOTE: with a non-zero Address the mapping replaces whatever was mapped there before
+static void *MapCopyOnWrite(s32 File, u64 Size, void *Address)
+{
+    void *Memory = mmap(Address, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | (Address ? MAP_FIXED : 0), File, 0);
+    if (Memory == MAP_FAILED)
+    {
+        PrintMessage("Could not map %llu bytes of copy-on-write memory\n", (unsigned long long)Size);
         return 0;
     }
-    fseek(File, 0, SEEK_END);
-    FileSize = ftell(File);
-    fseek(File, 0, SEEK_SET);
-    Buffer = AllocateBuffer(FileSize);
-    fread(Buffer->Data, FileSize, 1, File);
-    fclose(File);
-    return Buffer;
+    return Memory;
+}
+
+static void CloseSharedMemoryFile(s32 File)
+{
+    if (File >= 0) close(File);
+}
+
+static s32 GetProcessorCount(void)
+{
+    long Count = sysconf(_SC_NPROCESSORS_ONLN);
+    return Count > 0 ? (s32)Count : 1;
+}
+
+static s32 IsDirectory(char *Path)
+{
+    struct stat Status;
+    if (stat(Path, &Status)) return 0;
+    return S_ISDIR(Status.st_mode);
+}
+
+static int ComparePaths(const void *A, const void *B)
+{
+    return strcmp(*(char **)A, *(char **)B);
+}
+
+// NOTE: not every filesystem fills in d_type, those entries are looked up the slow way
+static s32 IsRegularFileEntry(DIR *Directory, struct dirent *Entry)
+{
+    struct stat Status;
+    if (Entry->d_type != DT_UNKNOWN) return Entry->d_type == DT_REG;
+    return fstatat(dirfd(Directory), Entry->d_name, &Status, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(Status.st_mode);
+}
+
+/*
+  Returns the paths of the regular files in DirectoryPath, sorted by name, as one allocation that
+  holds the pointer array followed by the strings (free it with free). Returns 0 on failure.
+*/
+static char **ListDirectoryFiles(char *DirectoryPath, s32 *FileCount)
+{
+    DIR *Directory = opendir(DirectoryPath);
+    struct dirent *Entry;
+    s32 Count = 0, Capacity, StringBytes = 0, PathLength = strlen(DirectoryPath);
+    char **Paths, *Strings;
+    if (!Directory)
+    {
+        PrintMessage("Could not open directory %s\n", DirectoryPath);
+        return 0;
+    }
+    // NOTE: two passes, the first one only sizes the allocation
+    while ((Entry = readdir(Directory)))
+    {
+        if (!IsRegularFileEntry(Directory, Entry)) continue;
+        Count += 1;
+        StringBytes += PathLength + 1 + strlen(Entry->d_name) + 1;
+    }
+    if (Count == 0)
+    {
+        // NOTE: an empty directory is an empty batch, not a failure, so don't leave it to malloc(0)
+        closedir(Directory);
+        *FileCount = 0;
+        return calloc(1, sizeof(char *));
+    }
+    Paths = malloc(Count * sizeof(char *) + StringBytes);
+    if (!Paths)
+    {
+        closedir(Directory);
+        return 0;
+    }
+    Strings = (char *)(Paths + Count);
+    rewinddir(Directory);
+    Capacity = Count;
+    Count = 0;
+    while ((Entry = readdir(Directory)) && Count < Capacity)
+    {
+        if (!IsRegularFileEntry(Directory, Entry)) continue;
+        // NOTE: a file created between the passes could have a longer name than anything we sized for
+        if (Strings + PathLength + 1 + strlen(Entry->d_name) + 1 > (char *)(Paths + Capacity) + StringBytes) break;
+        Paths[Count++] = Strings;
+        Strings += sprintf(Strings, "%s/%s", DirectoryPath, Entry->d_name) + 1;
+    }
+    closedir(Directory);
+    qsort(Paths, Count, sizeof(char *), ComparePaths);
+    *FileCount = Count;
+    return Paths;
 }
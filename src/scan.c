@@ -0,0 +1,355 @@
+/*
+  Instruction length scan
+  =======================
+  ScanInstructionLengths works out, for every byte of a code region, how far a linear sweep that
+  reached that byte would advance: the length of the instruction starting there, or 1 for a byte the
+  sweep writes out as data (see SweepInstruction). Outside of prefixes that is a function of the
+  opcode byte and the ModRM byte after it, LengthScanTable[Opcode] plus the displacement the ModRM
+  byte asks for, so SSE4.1 and AVX2 work it out 16 and 32 bytes at a time. The table is looked up
+  with PSHUFB, one 16-entry row for every high nibble that holds anything but a plain length of 1.
+  Where the REG field of the ModRM byte picks an instruction we do not decode (the 0x80-0x83 group),
+  the opcode is flagged LENGTH_SCAN_REG_CHECK and the REG field is looked up in
+  LengthScanUnknownRegs, which also fits in one PSHUFB. Only prefixes, and any opcode that fits
+  neither pattern, are flagged LENGTH_SCAN_EXACT and left to the decoder. MarkInstructionStarts
+  follows the lengths from a known start into a bitmap of instruction boundaries.
+*/
+#define LENGTH_SCAN_LENGTH_MASK 0x0f
+// NOTE: a ModRM byte follows, add the displacement it selects
+#define LENGTH_SCAN_MODRM 0x10
+// NOTE: the bytes are data (length 1) when the REG field of the ModRM byte is set in LengthScanUnknownRegs
+#define LENGTH_SCAN_REG_CHECK 0x20
+#define LENGTH_SCAN_EXACT 0x80
+
+static u8 LengthScanTable[256] __attribute__((aligned(16)));
+static u8 DisplacementLengthTable[256];
+// NOTE: 0xff for every REG value the LENGTH_SCAN_REG_CHECK opcodes cannot decode, 0 for the rest, padded to 16 for PSHUFB
+static u8 LengthScanUnknownRegs[16] __attribute__((aligned(16)));
+// NOTE: the high nibbles whose table row is not all plain 1s, only these rows are looked up
+static u8 LengthScanRows[16];
+static s32 LengthScanRowCount;
+static length_scan_kind BestLengthScan;
+static char *LengthScanNameTable[length_scan_Count] = {"scalar", "sse4.1", "avx2"};
+
+// NOTE: the decoder reports an unknown opcode as an error, the sweep checks first and writes the byte as data instead
+static s32 IsKnownOpcode(u8 *Bytes)
+{
+    s32 I = 0, HasSegmentOverride = 0, HasRepeatPrefix = 0;
+    for (;;)
+    {
+        if (!HasSegmentOverride && IS_SEGMENT_OVERRIDE_PREFIX(Bytes[I])) HasSegmentOverride = 1;
+        else if (!HasRepeatPrefix && IS_REPEAT_PREFIX(Bytes[I])) HasRepeatPrefix = 1;
+        else break;
+        I += 1;
+    }
+    return OpcodeDispatchTable[Bytes[I]].Opcode.Kind != opcode_kind_None;
+}
+
+// NOTE: whether a linear sweep prints the bytes as an instruction, Remaining bytes are left in the input
+static s32 DecodeSweepInstruction(u8 *Bytes, u64 Remaining, decoded_instruction *Instruction)
+{
+    return IsKnownOpcode(Bytes) && !DecodeInstruction(Bytes, 0, 0, Instruction) &&
+        Instruction->Length <= Remaining &&
+        (Instruction->Opcode.InstructionKind != instruction_kind_NONE || Instruction->Opcode.Kind == opcode_kind_Halt);
+}
+
+static s32 GetSweepLength(u8 *Bytes, u64 Remaining)
+{
+    decoded_instruction Instruction;
+    return DecodeSweepInstruction(Bytes, Remaining, &Instruction) ? Instruction.Length : 1;
+}
+
+static s32 CanUseLengthScan(length_scan_kind Kind)
+{
+    switch(Kind)
+    {
+    case length_scan_Scalar: return 1;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    case length_scan_Sse4: return __builtin_cpu_supports("sse4.1");
+    case length_scan_Avx2: return __builtin_cpu_supports("avx2");
+#endif
+    default: return 0;
+    }
+}
+
+// NOTE: the sweep length of Opcode for every REG value of a register-form ModRM byte, returns whether any of them decoded
+static s32 GetLengthsByReg(u8 Opcode, u8 *LengthsByReg)
+{
+    s32 Reg, IsKnown = 0;
+    for (Reg = 0; Reg < 8; ++Reg)
+    {
+        // NOTE: MOD = 11 has no displacement, so this decodes to the length without one
+        u8 Bytes[MAX_INSTRUCTION_LENGTH] = {Opcode, 0b11000000 | (Reg << 3)};
+        LengthsByReg[Reg] = GetSweepLength(Bytes, MAX_INSTRUCTION_LENGTH);
+        if (LengthsByReg[Reg] > 1 || OpcodeDispatchTable[Opcode].Opcode.Kind == opcode_kind_Halt) IsKnown = 1;
+    }
+    return IsKnown;
+}
+
+static void InitLengthScanTables(void)
+{
+    s32 I, Row, Reg, HasUnknownRegs = 0;
+    for (I = 0; I < 256; ++I)
+    {
+        u8 Mod = I >> 6, RM = I & 0b111;
+        u8 LengthsByReg[8], Length = 0;
+        s32 IsRegDependent = 0;
+        DisplacementLengthTable[I] = Mod == 0b01 ? 1 : Mod == 0b10 ? 2 : (Mod == 0b00 && RM == 0b110) ? 2 : 0;
+        if (IS_SEGMENT_OVERRIDE_PREFIX(I) || IS_REPEAT_PREFIX(I))
+        {
+            LengthScanTable[I] = LENGTH_SCAN_EXACT | 1;
+            continue;
+        }
+        if (!GetLengthsByReg(I, LengthsByReg))
+        {
+            LengthScanTable[I] = 1;
+            continue;
+        }
+        if (!(OpcodeDispatchTable[I].Flags & opcode_flag_ModRM))
+        {
+            LengthScanTable[I] = LengthsByReg[0];
+            continue;
+        }
+        for (Reg = 0; Reg < 8; ++Reg)
+        {
+            if (LengthsByReg[Reg] == 1) IsRegDependent = 1;
+            else if (!Length) Length = LengthsByReg[Reg];
+            else if (Length != LengthsByReg[Reg]) Length = 0xff;
+        }
+        LengthScanTable[I] = Length | LENGTH_SCAN_MODRM;
+        if (Length == 0xff) LengthScanTable[I] = LENGTH_SCAN_EXACT | 1;
+        else if (IsRegDependent)
+        {
+            // NOTE: the first opcode that needs a REG check sets the pattern, one that differs from it goes to the decoder
+            s32 Matches = 1;
+            for (Reg = 0; Reg < 8; ++Reg)
+            {
+                u8 IsUnknown = LengthsByReg[Reg] == 1 ? 0xff : 0;
+                if (!HasUnknownRegs) LengthScanUnknownRegs[Reg] = IsUnknown;
+                else if (LengthScanUnknownRegs[Reg] != IsUnknown) Matches = 0;
+            }
+            HasUnknownRegs = 1;
+            LengthScanTable[I] = Matches ? (LengthScanTable[I] | LENGTH_SCAN_REG_CHECK) : (LENGTH_SCAN_EXACT | 1);
+        }
+    }
+    LengthScanRowCount = 0;
+    for (Row = 0; Row < 16; ++Row)
+    {
+        for (I = 0; I < 16 && LengthScanTable[16 * Row + I] == 1; ++I);
+        if (I < 16) LengthScanRows[LengthScanRowCount++] = Row;
+    }
+    BestLengthScan = length_scan_Scalar;
+    if (CanUseLengthScan(length_scan_Sse4)) BestLengthScan = length_scan_Sse4;
+    if (CanUseLengthScan(length_scan_Avx2)) BestLengthScan = length_scan_Avx2;
+}
+
+static void ScanLengthsScalar(u8 *Bytes, s32 Start, s32 Count, u8 *Lengths)
+{
+    s32 I;
+    for (I = Start; I < Count; ++I)
+    {
+        u8 Entry = LengthScanTable[Bytes[I]];
+        Lengths[I] = (Entry & LENGTH_SCAN_LENGTH_MASK) + ((Entry & LENGTH_SCAN_MODRM) ? DisplacementLengthTable[Bytes[I + 1]] : 0);
+        if ((Entry & LENGTH_SCAN_REG_CHECK) && LengthScanUnknownRegs[(Bytes[I + 1] >> 3) & 0b111]) Lengths[I] = 1;
+        if (Entry & LENGTH_SCAN_EXACT) Lengths[I] = GetSweepLength(Bytes + I, MAX_INSTRUCTION_LENGTH);
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+
+// NOTE: ExactMask has a bit for every byte of the block at Bytes that the decoder has to finish
+static void FinishExactLengths(u8 *Bytes, u8 *Lengths, u32 ExactMask)
+{
+    while (ExactMask)
+    {
+        s32 Bit = __builtin_ctz(ExactMask);
+        Lengths[Bit] = GetSweepLength(Bytes + Bit, MAX_INSTRUCTION_LENGTH);
+        ExactMask &= ExactMask - 1;
+    }
+}
+
+__attribute__((target("sse4.1")))
+static s32 ScanLengthsSse4(u8 *Bytes, s32 Count, u8 *Lengths)
+{
+    __m128i LowNibbleMask = _mm_set1_epi8(0x0f), ModMask = _mm_set1_epi8((char)0b11000000);
+    __m128i DirectMask = _mm_set1_epi8((char)0b11000111), Direct = _mm_set1_epi8(0b00000110);
+    __m128i Mod01 = _mm_set1_epi8(0b01000000), Mod10 = _mm_set1_epi8((char)0b10000000);
+    __m128i One = _mm_set1_epi8(1), Two = _mm_set1_epi8(2), ModRMFlag = _mm_set1_epi8(LENGTH_SCAN_MODRM);
+    __m128i RegCheckFlag = _mm_set1_epi8(LENGTH_SCAN_REG_CHECK), RegMask = _mm_set1_epi8(0b111);
+    __m128i UnknownRegs = _mm_load_si128((__m128i *)LengthScanUnknownRegs);
+    s32 I, R;
+    for (I = 0; I + 16 <= Count; I += 16)
+    {
+        __m128i Opcodes = _mm_loadu_si128((__m128i *)(Bytes + I));
+        __m128i ModRM = _mm_loadu_si128((__m128i *)(Bytes + I + 1));
+        __m128i Low = _mm_and_si128(Opcodes, LowNibbleMask);
+        __m128i High = _mm_and_si128(_mm_srli_epi16(Opcodes, 4), LowNibbleMask);
+        __m128i Entry = One, Mod, Displacement, HasModRM, Length, IsUnknownReg;
+        for (R = 0; R < LengthScanRowCount; ++R)
+        {
+            s32 Row = LengthScanRows[R];
+            __m128i RowEntries = _mm_shuffle_epi8(_mm_load_si128((__m128i *)(LengthScanTable + 16 * Row)), Low);
+            Entry = _mm_blendv_epi8(Entry, RowEntries, _mm_cmpeq_epi8(High, _mm_set1_epi8(Row)));
+        }
+        Mod = _mm_and_si128(ModRM, ModMask);
+        Displacement = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi8(Mod, Mod01), One),
+                                    _mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(Mod, Mod10), _mm_cmpeq_epi8(_mm_and_si128(ModRM, DirectMask), Direct)), Two));
+        HasModRM = _mm_cmpeq_epi8(_mm_and_si128(Entry, ModRMFlag), ModRMFlag);
+        Length = _mm_add_epi8(_mm_and_si128(Entry, LowNibbleMask), _mm_and_si128(HasModRM, Displacement));
+        IsUnknownReg = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(Entry, RegCheckFlag), RegCheckFlag),
+                                     _mm_shuffle_epi8(UnknownRegs, _mm_and_si128(_mm_srli_epi16(ModRM, 3), RegMask)));
+        _mm_storeu_si128((__m128i *)(Lengths + I), _mm_blendv_epi8(Length, One, IsUnknownReg));
+        FinishExactLengths(Bytes + I, Lengths + I, (u32)_mm_movemask_epi8(Entry));
+    }
+    return I;
+}
+
+__attribute__((target("avx2")))
+static s32 ScanLengthsAvx2(u8 *Bytes, s32 Count, u8 *Lengths)
+{
+    __m256i LowNibbleMask = _mm256_set1_epi8(0x0f), ModMask = _mm256_set1_epi8((char)0b11000000);
+    __m256i DirectMask = _mm256_set1_epi8((char)0b11000111), Direct = _mm256_set1_epi8(0b00000110);
+    __m256i Mod01 = _mm256_set1_epi8(0b01000000), Mod10 = _mm256_set1_epi8((char)0b10000000);
+    __m256i One = _mm256_set1_epi8(1), Two = _mm256_set1_epi8(2), ModRMFlag = _mm256_set1_epi8(LENGTH_SCAN_MODRM);
+    __m256i RegCheckFlag = _mm256_set1_epi8(LENGTH_SCAN_REG_CHECK), RegMask = _mm256_set1_epi8(0b111);
+    __m256i UnknownRegs = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)LengthScanUnknownRegs));
+    __m256i Rows[16];
+    s32 I, R;
+    // NOTE: VPSHUFB looks up within each 128-bit lane, so both lanes get a copy of the row
+    for (R = 0; R < LengthScanRowCount; ++R) Rows[R] = _mm256_broadcastsi128_si256(_mm_load_si128((__m128i *)(LengthScanTable + 16 * LengthScanRows[R])));
+    for (I = 0; I + 32 <= Count; I += 32)
+    {
+        __m256i Opcodes = _mm256_loadu_si256((__m256i *)(Bytes + I));
+        __m256i ModRM = _mm256_loadu_si256((__m256i *)(Bytes + I + 1));
+        __m256i Low = _mm256_and_si256(Opcodes, LowNibbleMask);
+        __m256i High = _mm256_and_si256(_mm256_srli_epi16(Opcodes, 4), LowNibbleMask);
+        __m256i Entry = One, Mod, Displacement, HasModRM, Length, IsUnknownReg;
+        for (R = 0; R < LengthScanRowCount; ++R)
+        {
+            __m256i RowEntries = _mm256_shuffle_epi8(Rows[R], Low);
+            Entry = _mm256_blendv_epi8(Entry, RowEntries, _mm256_cmpeq_epi8(High, _mm256_set1_epi8(LengthScanRows[R])));
+        }
+        Mod = _mm256_and_si256(ModRM, ModMask);
+        Displacement = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(Mod, Mod01), One),
+                                       _mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(Mod, Mod10), _mm256_cmpeq_epi8(_mm256_and_si256(ModRM, DirectMask), Direct)), Two));
+        HasModRM = _mm256_cmpeq_epi8(_mm256_and_si256(Entry, ModRMFlag), ModRMFlag);
+        Length = _mm256_add_epi8(_mm256_and_si256(Entry, LowNibbleMask), _mm256_and_si256(HasModRM, Displacement));
+        IsUnknownReg = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(Entry, RegCheckFlag), RegCheckFlag),
+                                        _mm256_shuffle_epi8(UnknownRegs, _mm256_and_si256(_mm256_srli_epi16(ModRM, 3), RegMask)));
+        _mm256_storeu_si256((__m256i *)(Lengths + I), _mm256_blendv_epi8(Length, One, IsUnknownReg));
+        FinishExactLengths(Bytes + I, Lengths + I, (u32)_mm256_movemask_epi8(Entry));
+    }
+    return I;
+}
+#endif
+
+/*
+  Fills Lengths[0..Count) for the code at Bytes, which must be readable for Count +
+  MAX_INSTRUCTION_LENGTH bytes and zeroed past the end of the input. Remaining is how many bytes of
+  input there are from Bytes on; an instruction that would run past them is cut off, length 1.
+*/
+static void ScanInstructionLengths(length_scan_kind Kind, u8 *Bytes, s32 Count, u64 Remaining, u8 *Lengths)
+{
+    s32 Done = 0, I;
+    if (!CanUseLengthScan(Kind)) Kind = length_scan_Scalar;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (Kind == length_scan_Avx2) Done = ScanLengthsAvx2(Bytes, Count, Lengths);
+    else if (Kind == length_scan_Sse4) Done = ScanLengthsSse4(Bytes, Count, Lengths);
+#endif
+    ScanLengthsScalar(Bytes, Done, Count, Lengths);
+    I = Remaining > MAX_INSTRUCTION_LENGTH ? (s32)(Remaining - MAX_INSTRUCTION_LENGTH) : 0;
+    for (; I < Count && (u64)I < Remaining; ++I)
+    {
+        if ((u64)I + Lengths[I] > Remaining) Lengths[I] = 1;
+    }
+}
+
+// NOTE: sets a bit in Starts for every instruction the sweep from Position reaches below Count, returns where the sweep leaves off
+static s32 MarkInstructionStarts(u8 *Lengths, s32 Count, s32 Position, u64 *Starts)
+{
+    memset(Starts, 0, ((Count + 63) / 64) * sizeof(u64));
+    while (Position < Count)
+    {
+        Starts[Position >> 6] |= (u64)1 << (Position & 63);
+        Position += Lengths[Position];
+    }
+    return Position;
+}
+
+static s32 IsInstructionStart(u64 *Starts, s32 Position)
+{
+    return (Starts[Position >> 6] >> (Position & 63)) & 1;
+}
+
+// NOTE: how many instructions start before Position, which is the index of the one at Position
+static s32 CountInstructionStarts(u64 *Starts, s32 Position)
+{
+    s32 I, Count = 0;
+    for (I = 0; I < Position >> 6; ++I) Count += __builtin_popcountll(Starts[I]);
+    if (Position & 63) Count += __builtin_popcountll(Starts[Position >> 6] & (((u64)1 << (Position & 63)) - 1));
+    return Count;
+}
+
+/*
+  Times the decoder against every length scan this machine can run, on each file in turn. All of
+  them compute the sweep length at every byte, so they are compared for equality as well.
+*/
+static s32 BenchmarkLengthScan(char **FilePaths, s32 FilePathCount, s32 RepeatCount)
+{
+    s32 I, Run, Result = 0;
+    for (I = 0; I < FilePathCount; ++I)
+    {
+        mapped_file File;
+        u8 *Bytes, *Expected, *Lengths;
+        s32 Position, Kind;
+        f64 StartSeconds, BestSeconds;
+        printf("; %s\n", FilePaths[I]);
+        if (MapFile(FilePaths[I], &File))
+        {
+            Result = 1;
+            continue;
+        }
+        Bytes = calloc(1, (size)File.Size + MAX_INSTRUCTION_LENGTH);
+        Expected = malloc((size)File.Size + 1);
+        Lengths = malloc((size)File.Size + 1);
+        if (!Bytes || !Expected || !Lengths)
+        {
+            free(Bytes);
+            free(Expected);
+            free(Lengths);
+            UnmapFile(&File);
+            return ErrorMessageAndCode("Could not allocate the length scan buffers\n", 1);
+        }
+        if (File.Size) memcpy(Bytes, File.Data, File.Size);
+        BestSeconds = 0;
+        for (Run = 0; Run < RepeatCount; ++Run)
+        {
+            StartSeconds = GetWallClockSeconds();
+            for (Position = 0; Position < File.Size; ++Position) Expected[Position] = GetSweepLength(Bytes + Position, File.Size - Position);
+            StartSeconds = GetWallClockSeconds() - StartSeconds;
+            if (!Run || StartSeconds < BestSeconds) BestSeconds = StartSeconds;
+        }
+        printf("Length scan decoder: %d bytes, best of %d runs %.4f seconds, %.1f MB/s\n", File.Size, RepeatCount, BestSeconds,
+               BestSeconds > 0 ? (f64)File.Size / BestSeconds / 1000000.0 : 0.0);
+        for (Kind = 0; Kind < length_scan_Count; ++Kind)
+        {
+            if (!CanUseLengthScan(Kind)) continue;
+            for (Run = 0; Run < RepeatCount; ++Run)
+            {
+                StartSeconds = GetWallClockSeconds();
+                ScanInstructionLengths(Kind, Bytes, File.Size, File.Size, Lengths);
+                StartSeconds = GetWallClockSeconds() - StartSeconds;
+                if (!Run || StartSeconds < BestSeconds) BestSeconds = StartSeconds;
+            }
+            printf("Length scan %s: %d bytes, best of %d runs %.4f seconds, %.1f MB/s, %s\n", LengthScanNameTable[Kind], File.Size, RepeatCount, BestSeconds,
+                   BestSeconds > 0 ? (f64)File.Size / BestSeconds / 1000000.0 : 0.0,
+                   memcmp(Expected, Lengths, File.Size) ? "MISMATCH" : "matches the decoder");
+            if (memcmp(Expected, Lengths, File.Size)) Result = 1;
+        }
+        free(Bytes);
+        free(Expected);
+        free(Lengths);
+        UnmapFile(&File);
+    }
+    return Result;
+}
@@ -1,5 +1,3 @@
-// TODO: implement carry flag!
-
 /*
   Comments with the DOCS: tag are usually copy-pasted from the 8086 manual:
   https://archive.org/details/bitsavers_intel80869lyUsersManualOct79_62967963
@@ -7,12 +5,71 @@
 
 
 #include "sim.h"
+
+// NOTE: set by batch workers to the job they are running, so that messages stay with their program
+static __thread batch_job *ThreadBatchJob = 0;
+
+static void BatchJobPrintArguments(batch_job *Job, char *Format, va_list Arguments)
+{
+    va_list Copy;
+    s32 Length, NewSize;
+    char *Output;
+    if (Job->OutputHasFailed) return;
+    va_copy(Copy, Arguments);
+    Length = vsnprintf(0, 0, Format, Copy);
+    va_end(Copy);
+    if (Length < 0) return;
+    // NOTE: room for the terminator vsnprintf writes, OutputUsed only counts the text
+    for (NewSize = Job->OutputSize ? Job->OutputSize : BATCH_OUTPUT_SIZE; NewSize < Job->OutputUsed + Length + 1 && NewSize <= 0x3fffffff;) NewSize *= 2;
+    if (NewSize != Job->OutputSize)
+    {
+        Output = NewSize >= Job->OutputUsed + Length + 1 ? realloc(Job->Output, NewSize) : 0;
+        if (!Output)
+        {
+            Job->OutputHasFailed = 1;
+            Job->OutputUsed = 0;
+            return;
+        }
+        Job->Output = Output;
+        Job->OutputSize = NewSize;
+    }
+    vsnprintf(Job->Output + Job->OutputUsed, Length + 1, Format, Arguments);
+    Job->OutputUsed += Length;
+}
+
+static void BatchJobPrint(batch_job *Job, char *Format, ...)
+{
+    va_list Arguments;
+    va_start(Arguments, Format);
+    BatchJobPrintArguments(Job, Format, Arguments);
+    va_end(Arguments);
+}
+
+// NOTE: for messages about the program being run, a batch worker keeps them in its job's output
+static void PrintMessage(char *Format, ...)
+{
+    va_list Arguments;
+    va_start(Arguments, Format);
+    if (ThreadBatchJob) BatchJobPrintArguments(ThreadBatchJob, Format, Arguments);
+    else vprintf(Format, Arguments);
+    va_end(Arguments);
+}
+
+static s32 ErrorMessageAndCode(char *Message, s32 Code)
+{
+    PrintMessage("ERROR: %s", Message);
+    return Code;
+}
+
 #include "platform.c"
 
 #define MAX_PROGRAM_SIZE 1024
 
 #define HALT_INSTRUCTION 0b11110100
 
+// NOTE: returned by the HALT handler to stop the simulate loop, it is not an error
+#define SIMULATE_HALTED 2
+
 /*
   DOCS: The first six bits of a multibyte instruction generally contain an opcode
   that identifies the basic instruction type: ADD, XOR, etc.
@@ -63,21 +120,143 @@
 #define RM_MASK 0b111
 #define GET_RM(b) (RM_MASK & (b))
 
-#define OPCODE_COUNT (1 << OPCODE_BITS)
+/*
+  DOCS: A segment override prefix (001 sr 110) makes the memory operand of the next instruction use the
+  segment register named by sr instead of the default DS, or SS for addresses based on BP.
+*/
+#define IS_SEGMENT_OVERRIDE_PREFIX(b) (((b) & 0b11100111) == 0b00100110)
+#define GET_SEGMENT_OVERRIDE(b) (0b11 & ((b) >> 3))
+
+/*
+  DOCS: REP (REPE/REPZ with CMPS and SCAS) and REPNE/REPNZ repeat the string instruction that follows
+  them CX times, CMPS and SCAS also stop as soon as ZF no longer matches the prefix.
+*/
+#define REPNE_PREFIX 0b11110010
+#define REP_PREFIX 0b11110011
+#define IS_REPEAT_PREFIX(b) (((b) & 0b11111110) == REPNE_PREFIX)
+
 #define MOD_COUNT (1 << MOD_BITS)
 #define REG_COUNT (1 << REG_BITS)
 #define W_COUNT (1 << REG_BITS)
 #define RM_COUNT (1 << RM_BITS)
 
-#define MOV_IMMEDIATE_TO_REGISTER_MEMORY 0b110001
-#define MOV_ACCUMULATOR_TO_FROM_MEMORY 0b101000
 
 #define REGISTER_COUNT 13
-u16 GlobalRegisters[REGISTER_COUNT] = {};
 #define FLAG_COUNT 9
-u16 GlobalFlags = 0;
-#define GLOBAL_MEMORY_SIZE 1024 * 1024
-u8 GlobalMemory[GLOBAL_MEMORY_SIZE];
+#define MEMORY_SIZE (1024 * 1024)
+
+/*
+  Guest memory is tracked in MEMORY_PAGE_SIZE pages. A page is marked dirty when anything writes to it
+  (WriteMemory, the program loader), so a reset only has to zero the dirty pages and a dump only has
+  to save them; every clean page is known to be zero.
+*/
+#define MEMORY_PAGE_SHIFT 8
+#define MEMORY_PAGE_SIZE (1 << MEMORY_PAGE_SHIFT)
+#define MEMORY_PAGE_COUNT (MEMORY_SIZE >> MEMORY_PAGE_SHIFT)
+
+/*
+  Guest memory wraps at MEMORY_SIZE like the 8086's 20-bit address bus. Instead of checking every
+  access for the wrap, the arena holds MEMORY_SHADOW_SIZE bytes past the end that always mirror the
+  first bytes of memory, followed by a guard page. Any access that starts inside memory and is at most
+  MEMORY_SHADOW_SIZE bytes long is a plain load with no bounds check. Writes keep the shadow in sync
+  (see MarkMemoryDirty), and anything that runs further than that hits the guard page.
+*/
+#define MEMORY_SHADOW_SIZE 16
+
+/*
+  The decode cache holds one decoded_instruction per possible IP value. An entry is filled the first
+  time the instruction at that IP runs and is thrown away when a memory write touches its bytes.
+  MAX_INSTRUCTION_LENGTH counts a segment override and a repeat prefix in front of the longest instruction.
+*/
+#define MAX_INSTRUCTION_LENGTH 8
+#define DECODE_CACHE_SIZE (1 << 16)
+
+/*
+  The block cache holds translated basic blocks keyed by the IP of their first instruction. Their
+  decoded instructions live in one flat pool that is only ever appended to; when the pool or the
+  block table fills up the whole cache is flushed.
+*/
+#define MAX_BLOCK_LENGTH 64
+#define MAX_BLOCK_COUNT 4096
+#define BLOCK_INSTRUCTION_POOL_SIZE (MAX_BLOCK_COUNT * 16)
+
+/*
+  Every byte that a cached instruction or translated block was decoded from is marked in
+  CodeByteFlags, so a memory write only looks for stale translations when it actually lands on code.
+*/
+#define CODE_BYTE_DECODED 0x1
+#define CODE_BYTE_TRANSLATED 0x2
+
+/*
+  One simulated machine. Everything a simulation writes lives in here and is reached through the
+  Context argument, so independent machines can run on different threads; the only process-wide
+  state left is lookup tables that are filled once by InitSimulatorTables and then only read.
+*/
+struct sim_context
+{
+    // NOTE: RegisterBytes aliases Registers so that byte registers are plain loads and stores (see RegisterOffsetTable)
+    union
+    {
+        u16 Registers[REGISTER_COUNT];
+        u8 RegisterBytes[REGISTER_COUNT * sizeof(u16)];
+    };
+    // NOTE: the 20-bit base of every segment register, kept up to date by SimulateMoveToSegmentRegister and UpdateSegmentBases
+    u32 SegmentBases[segment_Count];
+    u16 Flags;
+    // NOTE: while LazyFlags.Op is not lazy_flags_op_None, the ARITHMETIC_FLAGS bits of Flags are stale
+    lazy_flags LazyFlags;
+    u8 *Memory;
+    // NOTE: Memory plus its shadow and guard page, the size to unmap
+    u64 MemoryArenaSize;
+    u64 DirtyPages[MEMORY_PAGE_COUNT / 64];
+
+    decoded_instruction DecodeCache[DECODE_CACHE_SIZE];
+    u8 DecodeCacheIsValid[DECODE_CACHE_SIZE];
+    decode_cache_stats DecodeCacheStats;
+    u64 InstructionCount;
+    // NOTE: conditional jumps and loops executed, taken or not
+    u64 JumpCount;
+    // NOTE: the outcome of the last jump or loop the handlers ran; a taken jump to $+2 leaves IP where not taking it would
+    u16 LastJumpTaken;
+
+    translated_block Blocks[MAX_BLOCK_COUNT];
+    s32 BlockCount;
+    decoded_instruction BlockInstructionPool[BLOCK_INSTRUCTION_POOL_SIZE];
+    s32 BlockInstructionPoolUsed;
+    // NOTE: holds the block index plus one, so zero means there is no block starting at that IP
+    s32 BlockIndexByIP[DECODE_CACHE_SIZE];
+    block_cache_stats BlockCacheStats;
+    s32 UseFusion;
+    fusion_stats FusionStats;
+    // NOTE: lets rep movs/stos run as one host memcpy/memset when the ranges allow it, see SimulateStringBulk
+    s32 UseBulkStrings;
+    // NOTE: see EstimateInstructionClocks, only the loop core counts clocks
+    clock_model ClockModel;
+    u64 ClockCount;
+    u64 ClockPenaltyCount;
+
+    u8 CodeByteFlags[DECODE_CACHE_SIZE];
+
+    jit_code_buffer JitCode;
+    jit_stats JitStats;
+};
+
+/*
+  Snapshots
+  =========
+  A snapshot keeps the registers and flags of a machine and writes its memory to a shared memory
+  file. RestoreSnapshot maps that file copy-on-write over a context's memory, so every machine
+  restored from one snapshot shares the pages it only reads and pays for a page the first time it
+  writes to it. Restoring never copies the megabyte of guest memory, and contexts keep their
+  mappings after the snapshot is freed.
+*/
+struct sim_snapshot
+{
+    u16 Registers[REGISTER_COUNT];
+    u16 Flags;
+    u64 DirtyPages[MEMORY_PAGE_COUNT / 64];
+    s32 MemoryFile;
+};
 
 s32 RegisterIndexTable[32] = {
     [AX] = 0, [AH] = 0, [AL] = 0,
@@ -89,33 +268,84 @@ s32 RegisterIndexTable[32] = {
     [IP] = 12,
 };
 
-opcode OpcodeTable[OPCODE_COUNT] = {
-    [0b100010] = {opcode_kind_RegisterMemoryToFromRegister,instruction_kind_Mov},
-    [0b110001] = {opcode_kind_ImmediateToRegisterMemory,instruction_kind_Mov},
-    [0b101100] = {opcode_kind_ImmediateToRegister,instruction_kind_Mov},
-    [0b101101] = {opcode_kind_ImmediateToRegister,instruction_kind_Mov},
-    [0b101110] = {opcode_kind_ImmediateToRegister,instruction_kind_Mov},
-    [0b101111] = {opcode_kind_ImmediateToRegister,instruction_kind_Mov},
-    [0b101000] = {opcode_kind_MemoryAccumulator,instruction_kind_Mov},
-    [0b100011] = {opcode_kind_SegmentRegister,instruction_kind_Mov},
-    [0b000000] = {opcode_kind_RegisterMemoryToFromRegister,instruction_kind_Add},
-    [0b000001] = {opcode_kind_MemoryAccumulator,instruction_kind_Add},
-    [0b001010] = {opcode_kind_RegisterMemoryToFromRegister,instruction_kind_Sub},
-    [0b001011] = {opcode_kind_MemoryAccumulator,instruction_kind_Sub},
-    [0b001110] = {opcode_kind_RegisterMemoryToFromRegister,instruction_kind_Cmp},
-    [0b001111] = {opcode_kind_MemoryAccumulator,instruction_kind_Cmp},
-    [0b100000] = {opcode_kind_ImmediateToRegisterMemory,instruction_kind_Derived},
-    [0b011101] = {opcode_kind_Jump,instruction_kind_Derived},
-    [0b011111] = {opcode_kind_Jump,instruction_kind_Derived},
-    [0b011100] = {opcode_kind_Jump,instruction_kind_Derived},
-    [0b011110] = {opcode_kind_Jump,instruction_kind_Derived},
-    [0b111000] = {opcode_kind_Jump,instruction_kind_Derived},
-    [0b111101] = {opcode_kind_Halt,instruction_kind_NONE},
+/*
+  Where each register lives in RegisterBytes and which bits of the 16-bit word at that offset are its
+  own. The halves of AX..DX share the word's bytes, low byte first as the host is little-endian.
+  UNKNOWN_REGISTER has an empty mask, it reads as zero and ignores writes.
+*/
+static const u8 RegisterOffsetTable[32] = {
+    [AX] = 0, [AH] = 1, [AL] = 0,
+    [BX] = 2, [BH] = 3, [BL] = 2,
+    [CX] = 4, [CH] = 5, [CL] = 4,
+    [DX] = 6, [DH] = 7, [DL] = 6,
+    [SP] = 8, [BP] = 10, [SI] = 12, [DI] = 14,
+    [CS] = 16, [DS] = 18, [SS] = 20, [ES] = 22,
+    [IP] = 24,
+};
+
+static const u16 RegisterMaskTable[32] = {
+    [AX] = 0xffff, [AH] = 0x00ff, [AL] = 0x00ff,
+    [BX] = 0xffff, [BH] = 0x00ff, [BL] = 0x00ff,
+    [CX] = 0xffff, [CH] = 0x00ff, [CL] = 0x00ff,
+    [DX] = 0xffff, [DH] = 0x00ff, [DL] = 0x00ff,
+    [SP] = 0xffff, [BP] = 0xffff, [SI] = 0xffff, [DI] = 0xffff,
+    [CS] = 0xffff, [DS] = 0xffff, [SS] = 0xffff, [ES] = 0xffff,
+    [IP] = 0xffff,
+};
+
+static simulate_handler SimulateRegisterToRegister;
+static simulate_handler SimulateMoveToSegmentRegister;
+static simulate_handler SimulateString;
+static simulate_handler SimulateFlagControl;
+static simulate_handler SimulateRegisterAndEffectiveAddress;
+static simulate_handler SimulateImmediateToRegisterMemory;
+static simulate_handler SimulateImmediateToEffectiveAddress;
+static simulate_handler SimulateImmediateToRegister;
+static simulate_handler SimulateMemoryAccumulator;
+static simulate_handler SimulateJump;
+static simulate_handler SimulateLoop;
+static simulate_handler SimulateHalt;
+
+simulate_handler *SimulateHandlerTable[simulate_op_Count] = {
+    [simulate_op_RegisterToRegister] = SimulateRegisterToRegister,
+    [simulate_op_MoveToSegmentRegister] = SimulateMoveToSegmentRegister,
+    [simulate_op_String] = SimulateString,
+    [simulate_op_FlagControl] = SimulateFlagControl,
+    [simulate_op_RegisterAndEffectiveAddress] = SimulateRegisterAndEffectiveAddress,
+    [simulate_op_ImmediateToRegisterMemory] = SimulateImmediateToRegisterMemory,
+    [simulate_op_ImmediateToEffectiveAddress] = SimulateImmediateToEffectiveAddress,
+    [simulate_op_ImmediateToRegister] = SimulateImmediateToRegister,
+    [simulate_op_MemoryAccumulator] = SimulateMemoryAccumulator,
+    [simulate_op_Jump] = SimulateJump,
+    [simulate_op_Loop] = SimulateLoop,
+    [simulate_op_Halt] = SimulateHalt,
 };
 
-// TODO: maybe FullByteOpcodeTable should store opcodes instead of opcode_kinds
-opcode_kind FullByteOpcodeTable[256] = {
-    [0b11110100] = opcode_kind_Halt,
+#define REGISTER_MEMORY_FLAGS (opcode_flag_ModRM | opcode_flag_D | opcode_flag_W)
+opcode_dispatch OpcodeDispatchTable[256] = {
+    [0b00000000 ... 0b00000011] = {{opcode_kind_RegisterMemoryToFromRegister,instruction_kind_Add}, REGISTER_MEMORY_FLAGS, simulate_op_RegisterToRegister, simulate_op_RegisterAndEffectiveAddress},
+    [0b00000100 ... 0b00000101] = {{opcode_kind_MemoryAccumulator,instruction_kind_Add}, opcode_flag_D | opcode_flag_W, simulate_op_MemoryAccumulator, simulate_op_None},
+    [0b00101000 ... 0b00101011] = {{opcode_kind_RegisterMemoryToFromRegister,instruction_kind_Sub}, REGISTER_MEMORY_FLAGS, simulate_op_RegisterToRegister, simulate_op_RegisterAndEffectiveAddress},
+    [0b00101100 ... 0b00101101] = {{opcode_kind_MemoryAccumulator,instruction_kind_Sub}, opcode_flag_D | opcode_flag_W, simulate_op_MemoryAccumulator, simulate_op_None},
+    [0b00111000 ... 0b00111011] = {{opcode_kind_RegisterMemoryToFromRegister,instruction_kind_Cmp}, REGISTER_MEMORY_FLAGS, simulate_op_RegisterToRegister, simulate_op_RegisterAndEffectiveAddress},
+    [0b00111100 ... 0b00111101] = {{opcode_kind_MemoryAccumulator,instruction_kind_Cmp}, opcode_flag_D | opcode_flag_W, simulate_op_MemoryAccumulator, simulate_op_None},
+    [0b01110000 ... 0b01111111] = {{opcode_kind_Jump,instruction_kind_Derived}, 0, simulate_op_Jump, simulate_op_None},
+    [0b10000000 ... 0b10000011] = {{opcode_kind_ImmediateToRegisterMemory,instruction_kind_Derived}, REGISTER_MEMORY_FLAGS, simulate_op_ImmediateToRegisterMemory, simulate_op_ImmediateToEffectiveAddress},
+    [0b10001000 ... 0b10001011] = {{opcode_kind_RegisterMemoryToFromRegister,instruction_kind_Mov}, REGISTER_MEMORY_FLAGS, simulate_op_RegisterToRegister, simulate_op_RegisterAndEffectiveAddress},
+    [0b10001100]                = {{opcode_kind_SegmentRegister,instruction_kind_Mov}, opcode_flag_ModRM | opcode_flag_D, simulate_op_RegisterToRegister, simulate_op_RegisterAndEffectiveAddress},
+    [0b10001110]                = {{opcode_kind_SegmentRegister,instruction_kind_Mov}, opcode_flag_ModRM | opcode_flag_D, simulate_op_MoveToSegmentRegister, simulate_op_MoveToSegmentRegister},
+    [0b10100000 ... 0b10100011] = {{opcode_kind_MemoryAccumulator,instruction_kind_Mov}, opcode_flag_D | opcode_flag_W, simulate_op_MemoryAccumulator, simulate_op_None},
+    [0b10100100 ... 0b10100101] = {{opcode_kind_String,instruction_kind_Movs}, opcode_flag_W, simulate_op_String, simulate_op_None},
+    [0b10100110 ... 0b10100111] = {{opcode_kind_String,instruction_kind_Cmps}, opcode_flag_W, simulate_op_String, simulate_op_None},
+    [0b10101010 ... 0b10101011] = {{opcode_kind_String,instruction_kind_Stos}, opcode_flag_W, simulate_op_String, simulate_op_None},
+    [0b10101100 ... 0b10101101] = {{opcode_kind_String,instruction_kind_Lods}, opcode_flag_W, simulate_op_String, simulate_op_None},
+    [0b10101110 ... 0b10101111] = {{opcode_kind_String,instruction_kind_Scas}, opcode_flag_W, simulate_op_String, simulate_op_None},
+    [0b10110000 ... 0b10111111] = {{opcode_kind_ImmediateToRegister,instruction_kind_Mov}, opcode_flag_RegW, simulate_op_ImmediateToRegister, simulate_op_None},
+    [0b11000110 ... 0b11000111] = {{opcode_kind_ImmediateToRegisterMemory,instruction_kind_Mov}, opcode_flag_ModRM | opcode_flag_W, simulate_op_ImmediateToRegisterMemory, simulate_op_ImmediateToEffectiveAddress},
+    [0b11100000 ... 0b11100011] = {{opcode_kind_Jump,instruction_kind_Derived}, 0, simulate_op_Loop, simulate_op_None},
+    [0b11110100]                = {{opcode_kind_Halt,instruction_kind_NONE}, 0, simulate_op_Halt, simulate_op_None},
+    [0b11111100]                = {{opcode_kind_FlagControl,instruction_kind_Cld}, 0, simulate_op_FlagControl, simulate_op_None},
+    [0b11111101]                = {{opcode_kind_FlagControl,instruction_kind_Std}, 0, simulate_op_FlagControl, simulate_op_None},
 };
 
 s32 RegTable[REG_COUNT][W_COUNT] = {
@@ -169,6 +399,19 @@ s32 EffectiveAddressCalculationTable[MOD_COUNT][RM_COUNT] = {
     },
 };
 
+address_form AddressFormTable[eac_Count] = {
+    [eac_NONE]           = {ADDRESS_NO_REGISTER, ADDRESS_NO_REGISTER, segment_DS},
+    [eac_DIRECT_ADDRESS] = {ADDRESS_NO_REGISTER, ADDRESS_NO_REGISTER, segment_DS},
+    [eac_BX_SI] = {BX, SI, segment_DS}, [eac_BX_SI_D8] = {BX, SI, segment_DS}, [eac_BX_SI_D16] = {BX, SI, segment_DS},
+    [eac_BX_DI] = {BX, DI, segment_DS}, [eac_BX_DI_D8] = {BX, DI, segment_DS}, [eac_BX_DI_D16] = {BX, DI, segment_DS},
+    [eac_BP_SI] = {BP, SI, segment_SS}, [eac_BP_SI_D8] = {BP, SI, segment_SS}, [eac_BP_SI_D16] = {BP, SI, segment_SS},
+    [eac_BP_DI] = {BP, DI, segment_SS}, [eac_BP_DI_D8] = {BP, DI, segment_SS}, [eac_BP_DI_D16] = {BP, DI, segment_SS},
+    [eac_SI] = {SI, ADDRESS_NO_REGISTER, segment_DS}, [eac_SI_D8] = {SI, ADDRESS_NO_REGISTER, segment_DS}, [eac_SI_D16] = {SI, ADDRESS_NO_REGISTER, segment_DS},
+    [eac_DI] = {DI, ADDRESS_NO_REGISTER, segment_DS}, [eac_DI_D8] = {DI, ADDRESS_NO_REGISTER, segment_DS}, [eac_DI_D16] = {DI, ADDRESS_NO_REGISTER, segment_DS},
+    [eac_BX] = {BX, ADDRESS_NO_REGISTER, segment_DS}, [eac_BX_D8] = {BX, ADDRESS_NO_REGISTER, segment_DS}, [eac_BX_D16] = {BX, ADDRESS_NO_REGISTER, segment_DS},
+    [eac_BP_D8] = {BP, ADDRESS_NO_REGISTER, segment_SS}, [eac_BP_D16] = {BP, ADDRESS_NO_REGISTER, segment_SS},
+};
+
 #define JUMP_CODE_BITS 8
 char *JumpInstructionNameTable[1 << JUMP_CODE_BITS] = {
   [0b01110100] = "je", // jz
@@ -193,6 +436,64 @@ char *JumpInstructionNameTable[1 << JUMP_CODE_BITS] = {
   [0b11100011] = "jcxz",
 };
 
+/*
+  Jump conditions
+  ===============
+  The sixteen Jcc opcodes (0x70-0x7f) carry their condition in the low nibble, and odd conditions are
+  the negation of the even one below them. Bit N of JumpConditionTable[Condition] says whether the
+  condition holds when the low bits of the flag word (C, P, A, Z, S and O) equal N, so evaluating any
+  jump is one shift and mask of the flags. Only the flags in JumpConditionFlags have to be correct in
+  that word.
+*/
+
+#define JUMP_CONDITION_FLAGS (flag_Carry | flag_Parity | flag_Aux_Carry | flag_Zero | flag_Sign | flag_Overflow)
+u64 JumpConditionTable[16];
+// NOTE: the flags each condition looks at
+u16 JumpConditionFlags[16] = {
+    flag_Overflow, flag_Overflow,
+    flag_Carry, flag_Carry,
+    flag_Zero, flag_Zero,
+    flag_Carry | flag_Zero, flag_Carry | flag_Zero,
+    flag_Sign, flag_Sign,
+    flag_Parity, flag_Parity,
+    flag_Sign | flag_Overflow, flag_Sign | flag_Overflow,
+    flag_Zero | flag_Sign | flag_Overflow, flag_Zero | flag_Sign | flag_Overflow,
+};
+
+static void InitJumpConditionTable(void)
+{
+    u32 Flags;
+    for (Flags = 0; Flags <= JUMP_CONDITION_FLAGS; ++Flags)
+    {
+        s32 Carry = (Flags & flag_Carry) != 0;
+        s32 Parity = (Flags & flag_Parity) != 0;
+        s32 Zero = (Flags & flag_Zero) != 0;
+        s32 Sign = (Flags & flag_Sign) != 0;
+        s32 Overflow = (Flags & flag_Overflow) != 0;
+        s32 Conditions[8] = {
+            Overflow,                    // jo
+            Carry,                       // jb
+            Zero,                        // je
+            Carry | Zero,                // jbe
+            Sign,                        // js
+            Parity,                      // jp
+            Sign != Overflow,            // jl
+            Zero | (Sign != Overflow),   // jle
+        };
+        s32 I;
+        for (I = 0; I < 8; ++I)
+        {
+            JumpConditionTable[2 * I] |= (u64)Conditions[I] << Flags;
+            JumpConditionTable[2 * I + 1] |= (u64)!Conditions[I] << Flags;
+        }
+    }
+}
+
+// NOTE: the JIT reads the tables above, so it is pulled in after them
+#include "jit.c"
+
+static char *SegmentPrefixTable[segment_Count] = {"es:", "cs:", "ss:", "ds:"};
+
 static char *GetEffectiveAddressDisplay(effective_address EffectiveAddress)
 {
     switch(EffectiveAddress)
@@ -222,13 +523,44 @@ static char *GetEffectiveAddressDisplay(effective_address EffectiveAddress)
     case eac_DI_D16: return "[di +";
     case eac_BP_D16: return "[bp +";
     case eac_BX_D16: return "[bx +";
+    case eac_Count: return "eac_Count";
     }
 }
 
-static s32 ErrorMessageAndCode(char *Message, s32 Code)
+/*
+  Display tables
+  ==============
+  The disassembler copies every mnemonic, register name and effective address from these tables
+  instead of formatting them per instruction. EffectiveAddressText leaves out the opening bracket so
+  that a segment override can go in front of it, "[es:" followed by "bx + si]". DecimalPairTable
+  holds "00" to "99", WriteDecimal turns two digits per division into one copy.
+*/
+static display_text InstructionKindText[instruction_kind_Count];
+static display_text RegisterNameText[32];
+static display_text EffectiveAddressText[eac_Count];
+static display_text SegmentPrefixText[segment_Count];
+static display_text JumpNameText[1 << JUMP_CODE_BITS];
+static char DecimalPairTable[200];
+
+static display_text MakeDisplayText(char *String)
 {
-    printf("ERROR: %s", Message);
-    return Code;
+    display_text Text = {String, String ? (s32)strlen(String) : 0};
+    return Text;
+}
+
+static void InitDisplayTables(void)
+{
+    s32 I;
+    for (I = 0; I < instruction_kind_Count; ++I) InstructionKindText[I] = MakeDisplayText(DisplayInstructionKind(I));
+    for (I = 0; I < ARRAY_COUNT(RegisterNameText); ++I) RegisterNameText[I] = MakeDisplayText(DisplayRegisterName(I));
+    for (I = 0; I < eac_Count; ++I) EffectiveAddressText[I] = MakeDisplayText(GetEffectiveAddressDisplay(I) + 1);
+    for (I = 0; I < segment_Count; ++I) SegmentPrefixText[I] = MakeDisplayText(SegmentPrefixTable[I]);
+    for (I = 0; I < ARRAY_COUNT(JumpNameText); ++I) JumpNameText[I] = MakeDisplayText(JumpInstructionNameTable[I]);
+    for (I = 0; I < 100; ++I)
+    {
+        DecimalPairTable[2 * I] = '0' + I / 10;
+        DecimalPairTable[2 * I + 1] = '0' + I % 10;
+    }
 }
 
 static s32 OnesCount(u16 Value)
@@ -247,109 +579,447 @@ static s32 GetRegisterIndex(s32 RegOrRM, s32 IsWide, s32 IsSegment)
     return IsSegment ? SegmentRegisterTable[(RegOrRM & 0b11)] : RegTable[RegOrRM][IsWide];
 }
 
-static s16 ReadRegister(register_name RegisterName)
+// NOTE: branch free, a byte register reads the word at its byte offset and masks off the neighbouring byte
+static s16 ReadRegister(sim_context *Context, register_name RegisterName)
+{
+    u16 Word;
+    memcpy(&Word, Context->RegisterBytes + RegisterOffsetTable[RegisterName], sizeof(Word));
+    return Word & RegisterMaskTable[RegisterName];
+}
+
+static void InvalidateAllCode(sim_context *Context);
+
+/*
+  Recomputes the cached segment bases from the segment registers. Call it after writing a segment
+  register, through WriteRegister or Registers directly. Code is cached by IP, so moving CS drops it.
+*/
+static void UpdateSegmentBases(sim_context *Context)
 {
-    s32 RegisterIndex = RegisterIndexTable[RegisterName];
-    switch(RegisterName)
+    s32 Segment;
+    u32 CodeBase = Context->SegmentBases[segment_CS];
+    for (Segment = 0; Segment < segment_Count; ++Segment)
     {
-    case AX: case BX: case CX: case DX:
-    case SP: case BP: case SI: case DI:
-    case CS: case DS: case SS: case ES:
-    case IP:
+        Context->SegmentBases[Segment] = (u32)Context->Registers[RegisterIndexTable[SegmentRegisterTable[Segment]]] << 4;
+    }
+    if (Context->SegmentBases[segment_CS] != CodeBase) InvalidateAllCode(Context);
+}
+
+/*
+  Branch free like ReadRegister: the masked bytes of Value are merged into the word at the register's
+  byte offset. Writing a segment register this way does not move its cached base, call
+  UpdateSegmentBases afterwards (SimulateMoveToSegmentRegister does).
+*/
+static void WriteRegister(sim_context *Context, register_name RegisterName, s16 Value)
+{
+    u8 *Bytes = Context->RegisterBytes + RegisterOffsetTable[RegisterName];
+    u16 Mask = RegisterMaskTable[RegisterName], Word;
+    memcpy(&Word, Bytes, sizeof(Word));
+    Word = (Word & ~Mask) | (Value & Mask);
+    memcpy(Bytes, &Word, sizeof(Word));
+}
+
+static void ResetDecodeCache(sim_context *Context)
+{
+    memset(Context->DecodeCacheIsValid, 0, sizeof(Context->DecodeCacheIsValid));
+    memset(&Context->DecodeCacheStats, 0, sizeof(Context->DecodeCacheStats));
+    memset(Context->CodeByteFlags, 0, sizeof(Context->CodeByteFlags));
+}
+
+static void FlushBlockCache(sim_context *Context)
+{
+    ResetJitCode(&Context->JitCode);
+    memset(Context->BlockIndexByIP, 0, sizeof(Context->BlockIndexByIP));
+    Context->BlockCount = 0;
+    Context->BlockInstructionPoolUsed = 0;
+}
+
+static void ResetBlockCache(sim_context *Context)
+{
+    FlushBlockCache(Context);
+    memset(&Context->BlockCacheStats, 0, sizeof(Context->BlockCacheStats));
+    memset(&Context->FusionStats, 0, sizeof(Context->FusionStats));
+}
+
+/*
+  Drops every cached decode and block after CS moves, since both caches are keyed by IP alone. The
+  block pool is left alone (unlike FlushBlockCache) because the block that wrote CS may still be running.
+*/
+static void InvalidateAllCode(sim_context *Context)
+{
+    s32 I;
+    memset(Context->DecodeCacheIsValid, 0, sizeof(Context->DecodeCacheIsValid));
+    memset(Context->CodeByteFlags, 0, sizeof(Context->CodeByteFlags));
+    memset(Context->BlockIndexByIP, 0, sizeof(Context->BlockIndexByIP));
+    for (I = 0; I < Context->BlockCount; ++I) Context->Blocks[I].IsValid = 0;
+}
+
+static void MarkCodeBytes(sim_context *Context, u16 InstructionPointer, s32 ByteCount, u8 Flag)
+{
+    s32 I;
+    for (I = 0; I < ByteCount; ++I)
     {
-        return 0xffff & GlobalRegisters[RegisterIndex];
-    } break;
-    case AH: case BH: case CH: case DH:
+        Context->CodeByteFlags[(u16)(InstructionPointer + I)] |= Flag;
+    }
+}
+
+static void InvalidateBlockCache(sim_context *Context, s32 MemoryIndex, s32 ByteCount)
+{
+    s32 I;
+    for (I = 0; I < Context->BlockCount; ++I)
     {
-        return 0xffff & ((GlobalRegisters[RegisterIndex] & 0xff00) >> 8);
-    } break;
-    case AL: case BL: case CL: case DL:
+        translated_block *Block = &Context->Blocks[I];
+        // NOTE: compare in IP space, a block that wraps past 0xffff is treated as ending at 0x10000
+        s32 BlockStart = Block->StartIP;
+        s32 BlockEnd = BlockStart + Block->ByteLength;
+        if (Block->IsValid && BlockStart < MemoryIndex + ByteCount && MemoryIndex < BlockEnd)
+        {
+            Block->IsValid = 0;
+            if (Context->BlockIndexByIP[Block->StartIP] == I + 1) Context->BlockIndexByIP[Block->StartIP] = 0;
+            Context->BlockCacheStats.Invalidations += 1;
+        }
+    }
+}
+
+static void InvalidateDecodeCache(sim_context *Context, s32 MemoryIndex, s32 ByteCount)
+{
+    // NOTE: an instruction starting up to MAX_INSTRUCTION_LENGTH-1 bytes before the write can still cover the written bytes.
+    s32 Start;
+    for (Start = MemoryIndex - (MAX_INSTRUCTION_LENGTH - 1); Start < MemoryIndex + ByteCount; ++Start)
     {
-        return GlobalRegisters[RegisterIndex] & 0xff;
-    } break;
-    case UNKNOWN_REGISTER: default:
-        return ErrorMessageAndCode("Read from unknown register\n", 0x7fffffff);
+        u16 CacheIndex = (u16)Start;
+        if (Context->DecodeCacheIsValid[CacheIndex] && Start + Context->DecodeCache[CacheIndex].Length > MemoryIndex)
+        {
+            Context->DecodeCacheIsValid[CacheIndex] = 0;
+            Context->DecodeCacheStats.Invalidations += 1;
+        }
     }
-    return 0;
 }
 
-static s32 WriteRegister(register_name RegisterName, s16 Value)
+static void SyncMemoryShadow(sim_context *Context)
+{
+    memcpy(Context->Memory + MEMORY_SIZE, Context->Memory, MEMORY_SHADOW_SIZE);
+}
+
+/*
+  Call after writing ByteCount bytes at physical address Start (below MEMORY_SIZE). Bytes that landed
+  in the shadow past the end of memory are moved to the start of memory where they belong, and the
+  shadow is refreshed when the first bytes of memory change.
+*/
+static void MarkMemoryDirty(sim_context *Context, u32 Start, u32 ByteCount)
 {
-    s32 RegisterIndex = RegisterIndexTable[RegisterName];
-    switch(RegisterName)
+    u32 Page, LastPage;
+    if (!ByteCount || Start >= MEMORY_SIZE) return;
+    if (Start + ByteCount > MEMORY_SIZE)
     {
-    case AX: case BX: case CX: case DX:
-    case SP: case BP: case SI: case DI:
-    case CS: case DS: case SS: case ES:
-    case IP:
+        // NOTE: the shadow already holds the wrapped bytes, so only the start of memory needs them
+        u32 WrappedCount = Start + ByteCount - MEMORY_SIZE;
+        memcpy(Context->Memory, Context->Memory + MEMORY_SIZE, WrappedCount);
+        ByteCount -= WrappedCount;
+        Context->DirtyPages[0] |= 1;
+    }
+    else if (Start < MEMORY_SHADOW_SIZE)
     {
-        GlobalRegisters[RegisterIndex] = Value;
-    } break;
-    case AH: case BH: case CH: case DH:
+        SyncMemoryShadow(Context);
+    }
+    LastPage = (Start + ByteCount - 1) >> MEMORY_PAGE_SHIFT;
+    for (Page = Start >> MEMORY_PAGE_SHIFT; Page <= LastPage; ++Page)
     {
-        GlobalRegisters[RegisterIndex] = ((0xff & Value) << 8) | (0xff & GlobalRegisters[RegisterIndex]);
-    } break;
-    case AL: case BL: case CL: case DL:
+        Context->DirtyPages[Page / 64] |= (u64)1 << (Page % 64);
+    }
+}
+
+/*
+  Plain accesses to physical guest memory. Address has to be below MEMORY_SIZE; a word at the last
+  byte reads its high byte from the shadow of address zero. Guest memory is little-endian like the
+  x86-64 hosts this runs on, so a word is a single unaligned load. Stores have to be followed by
+  MarkMemoryDirty.
+*/
+static u8 LoadPhysicalByte(u8 *Memory, u32 Address)
+{
+    return Memory[Address];
+}
+
+static u16 LoadPhysicalWord(u8 *Memory, u32 Address)
+{
+    u16 Value;
+    memcpy(&Value, Memory + Address, sizeof(Value));
+    return Value;
+}
+
+static void StorePhysicalByte(u8 *Memory, u32 Address, u8 Value)
+{
+    Memory[Address] = Value;
+}
+
+static void StorePhysicalWord(u8 *Memory, u32 Address, u16 Value)
+{
+    memcpy(Memory + Address, &Value, sizeof(Value));
+}
+
+static s32 IsPageDirty(u64 *DirtyPages, s32 Page)
+{
+    return (DirtyPages[Page / 64] >> (Page % 64)) & 1;
+}
+
+// NOTE: finds the next run of dirty pages at or after *Page and moves *Page past it, returns zero once there are none left
+static s32 NextDirtyRange(u64 *DirtyPages, s32 *Page, u32 *Start, u32 *ByteCount)
+{
+    s32 FirstPage;
+    while (*Page < MEMORY_PAGE_COUNT && !IsPageDirty(DirtyPages, *Page)) *Page += 1;
+    if (*Page >= MEMORY_PAGE_COUNT) return 0;
+    FirstPage = *Page;
+    while (*Page < MEMORY_PAGE_COUNT && IsPageDirty(DirtyPages, *Page)) *Page += 1;
+    *Start = (u32)FirstPage << MEMORY_PAGE_SHIFT;
+    *ByteCount = (u32)(*Page - FirstPage) << MEMORY_PAGE_SHIFT;
+    return 1;
+}
+
+// NOTE: zeroes guest memory by clearing only the pages written since the last reset
+static void ResetMemory(sim_context *Context)
+{
+    s32 I;
+    for (I = 0; I < ARRAY_COUNT(Context->DirtyPages); ++I)
     {
-        GlobalRegisters[RegisterIndex] = (0xff & Value) | (0xff00 & GlobalRegisters[RegisterIndex]);
-    } break;
-    case UNKNOWN_REGISTER: default:
-        return ErrorMessageAndCode("Write to unknown register\n", 1);
+        u64 Dirty = Context->DirtyPages[I];
+        while (Dirty)
+        {
+            s32 Page = I * 64 + __builtin_ctzll(Dirty);
+            memset(Context->Memory + ((u32)Page << MEMORY_PAGE_SHIFT), 0, MEMORY_PAGE_SIZE);
+            Dirty &= Dirty - 1;
+        }
+        Context->DirtyPages[I] = 0;
+    }
+    SyncMemoryShadow(Context);
+}
+
+// NOTE: the 20-bit address of Segment:Offset, wrapping at the end of the address space like the 8086 does
+static u32 PhysicalAddress(u16 Segment, u16 Offset)
+{
+    return (((u32)Segment << 4) + Offset) & (MEMORY_SIZE - 1);
+}
+
+/*
+  Replaces guest memory with Program at Segment:Offset followed by a HALT, and points CS:IP at it.
+  A program that does not fit between its load address and the end of memory is an error rather
+  than being cut short.
+*/
+static s32 LoadProgram(sim_context *Context, u8 *Program, s32 ProgramSize, u16 Segment, u16 Offset)
+{
+    u32 Address = PhysicalAddress(Segment, Offset);
+    if (ProgramSize < 0 || (u32)ProgramSize >= MEMORY_SIZE - Address)
+    {
+        return ErrorMessageAndCode("Program does not fit in memory at its load address\n", 1);
     }
+    ResetMemory(Context);
+    if (ProgramSize) memcpy(Context->Memory + Address, Program, ProgramSize);
+    Context->Memory[Address + ProgramSize] = HALT_INSTRUCTION;
+    MarkMemoryDirty(Context, Address, ProgramSize + 1);
+    WriteRegister(Context, CS, Segment);
+    WriteRegister(Context, IP, Offset);
+    UpdateSegmentBases(Context);
     return 0;
 }
 
-static s16 ReadMemory(s16 MemoryIndex, s32 IsWide)
+// NOTE: LoadProgram for a file on disk, the file is read straight into guest memory
+static s32 LoadProgramFile(sim_context *Context, char *FilePath, u16 Segment, u16 Offset)
 {
-    if (MemoryIndex < 0 || (s32)MemoryIndex >= GLOBAL_MEMORY_SIZE)
+    u32 Address = PhysicalAddress(Segment, Offset);
+    s32 ProgramSize;
+    ResetMemory(Context);
+    // NOTE: one byte is kept back for the HALT that ends every program
+    if (ReadFileIntoMemory(FilePath, Context->Memory + Address, MEMORY_SIZE - Address - 1, &ProgramSize))
     {
-        return ErrorMessageAndCode("ReadMemory memory index out-of-bounds\n", 1);
+        MarkMemoryDirty(Context, Address, ProgramSize);
+        return ErrorMessageAndCode("Could not load program\n", 1);
     }
-    return GlobalMemory[MemoryIndex];
+    Context->Memory[Address + ProgramSize] = HALT_INSTRUCTION;
+    MarkMemoryDirty(Context, Address, ProgramSize + 1);
+    WriteRegister(Context, CS, Segment);
+    WriteRegister(Context, IP, Offset);
+    UpdateSegmentBases(Context);
+    return 0;
+}
+
+/*
+  Typed guest memory access
+  =========================
+  Every data access names a segment base (Context->SegmentBases, the segment register times 16) and
+  a 16-bit offset.
+  Words are little-endian and read or written with a single load or store. Like the 8086, the
+  offset wraps inside its segment: a word at offset 0xffff takes its high byte from offset 0 of
+  the same segment, and the physical address wraps at the end of memory.
+*/
+
+static u8 ReadMemory8(u8 *Memory, u32 SegmentBase, u16 Offset)
+{
+    return LoadPhysicalByte(Memory, (SegmentBase + Offset) & (MEMORY_SIZE - 1));
+}
+
+static u16 ReadMemory16(u8 *Memory, u32 SegmentBase, u16 Offset)
+{
+    if (Offset == 0xffff) return ReadMemory8(Memory, SegmentBase, 0xffff) | (ReadMemory8(Memory, SegmentBase, 0) << 8);
+    return LoadPhysicalWord(Memory, (SegmentBase + Offset) & (MEMORY_SIZE - 1));
 }
 
-static s32 WriteMemory(s16 MemoryIndex, s16 Value, s32 IsWide)
+/*
+  The bookkeeping every store of ByteCount (one or two) bytes at Address needs: drops any decoded
+  instructions or translated blocks that overlap the bytes, and marks their pages dirty. Only stores
+  next to either end of memory take the general MarkMemoryDirty path for the shadow.
+*/
+static void CommitMemoryStore(sim_context *Context, u32 Address, s32 ByteCount)
 {
-    if (MemoryIndex < 0 || (s32)MemoryIndex >= GLOBAL_MEMORY_SIZE)
+    // NOTE: code is cached by IP; an address outside the code segment aliases some IP, which only costs a needless invalidation
+    u16 InstructionPointer = (u16)(Address - Context->SegmentBases[segment_CS]);
+    u8 CodeByteFlags = Context->CodeByteFlags[InstructionPointer] | Context->CodeByteFlags[(u16)(InstructionPointer + ByteCount - 1)];
+    if (CodeByteFlags)
     {
-        return ErrorMessageAndCode("WriteMemory memory index out-of-bounds\n", 1);
+        if (CodeByteFlags & CODE_BYTE_DECODED) InvalidateDecodeCache(Context, InstructionPointer, ByteCount);
+        if (CodeByteFlags & CODE_BYTE_TRANSLATED) InvalidateBlockCache(Context, InstructionPointer, ByteCount);
     }
-    if (IsWide)
+    if (Address - MEMORY_SHADOW_SIZE < MEMORY_SIZE - MEMORY_SHADOW_SIZE - 1)
     {
-        GlobalMemory[MemoryIndex] = Value;
+        u32 FirstPage = Address >> MEMORY_PAGE_SHIFT, LastPage = (Address + ByteCount - 1) >> MEMORY_PAGE_SHIFT;
+        Context->DirtyPages[FirstPage / 64] |= (u64)1 << (FirstPage % 64);
+        Context->DirtyPages[LastPage / 64] |= (u64)1 << (LastPage % 64);
     }
     else
     {
-        u8 HighBits = GlobalMemory[MemoryIndex] & 0xff00;
-        GlobalMemory[MemoryIndex] = HighBits | (Value & 0xff);
+        MarkMemoryDirty(Context, Address, ByteCount);
     }
-    return 0;
 }
 
-static s16 GetImmediate(s32 Offset, s32 IsWord)
+/*
+  CommitMemoryStore for a bulk store of ByteCount bytes at Address, which must not run past the end
+  of memory. Unlike single stores, only the part of the range inside the code segment is checked
+  for code, since a long store elsewhere would alias a large share of the IPs.
+*/
+static void CommitMemoryRange(sim_context *Context, u32 Address, s32 ByteCount)
+{
+    u32 CodeBase = Context->SegmentBases[segment_CS];
+    u32 Start = Address, End = Address + ByteCount;
+    u8 CodeByteFlags = 0;
+    u32 I;
+    // NOTE: a code segment that wraps around the end of memory is rare enough to just check the whole range
+    if (CodeBase + 0x10000 <= MEMORY_SIZE)
+    {
+        if (Start < CodeBase) Start = CodeBase;
+        if (End > CodeBase + 0x10000) End = CodeBase + 0x10000;
+    }
+    for (I = Start; I < End; ++I) CodeByteFlags |= Context->CodeByteFlags[(u16)(I - CodeBase)];
+    if (CodeByteFlags & CODE_BYTE_DECODED) InvalidateDecodeCache(Context, (u16)(Start - CodeBase), End - Start);
+    if (CodeByteFlags & CODE_BYTE_TRANSLATED) InvalidateBlockCache(Context, (u16)(Start - CodeBase), End - Start);
+    MarkMemoryDirty(Context, Address, ByteCount);
+}
+
+static void WriteMemory8(sim_context *Context, u32 SegmentBase, u16 Offset, u8 Value)
+{
+    u32 Address = (SegmentBase + Offset) & (MEMORY_SIZE - 1);
+    StorePhysicalByte(Context->Memory, Address, Value);
+    CommitMemoryStore(Context, Address, 1);
+}
+
+static void WriteMemory16(sim_context *Context, u32 SegmentBase, u16 Offset, u16 Value)
+{
+    u32 Address = (SegmentBase + Offset) & (MEMORY_SIZE - 1);
+    if (Offset == 0xffff)
+    {
+        WriteMemory8(Context, SegmentBase, 0xffff, Value & 0xff);
+        WriteMemory8(Context, SegmentBase, 0, Value >> 8);
+        return;
+    }
+    StorePhysicalWord(Context->Memory, Address, Value);
+    CommitMemoryStore(Context, Address, 2);
+}
+
+static u16 ReadMemoryValue(u8 *Memory, u32 SegmentBase, u16 Offset, s32 IsWide)
+{
+    return IsWide ? ReadMemory16(Memory, SegmentBase, Offset) : ReadMemory8(Memory, SegmentBase, Offset);
+}
+
+static void WriteMemoryValue(sim_context *Context, u32 SegmentBase, u16 Offset, u16 Value, s32 IsWide)
+{
+    if (IsWide) WriteMemory16(Context, SegmentBase, Offset, Value);
+    else WriteMemory8(Context, SegmentBase, Offset, Value & 0xff);
+}
+
+static u8 ReadInstructionByte(u8 *Memory, u32 CodeBase, u16 InstructionPointer, s32 Offset)
+{
+    return ReadMemory8(Memory, CodeBase, InstructionPointer + Offset);
+}
+
+// NOTE: IsSignExtended is set for the bytes the 8086 sign-extends: disp8, the imm8 of 0x83 and jump displacements
+static s16 GetImmediate(u8 *Memory, u32 CodeBase, u16 InstructionPointer, s32 Offset, s32 IsWord, s32 IsSignExtended)
+{
+    u8 Byte;
+    if (IsWord) return ReadMemory16(Memory, CodeBase, InstructionPointer + Offset);
+    Byte = ReadMemory8(Memory, CodeBase, InstructionPointer + Offset);
+    return IsSignExtended ? (s8)Byte : Byte;
+}
+
+/*
+  Lazy flags
+  ==========
+  Arithmetic handlers only record what they did (RecordFlags). Most results are overwritten by the
+  next add/sub/cmp before anything looks at them, so the flags are worked out from the record only
+  when a jump tests one (ReadFlag), or when something needs the whole word (MaterializeFlags).
+*/
+
+static void RecordFlags(sim_context *Context, lazy_flags_op Op, s32 IsWide, u16 Destination, u16 Source, u16 Result, u16 CarryIn)
+{
+    Context->LazyFlags.Op = Op;
+    Context->LazyFlags.IsWide = IsWide;
+    Context->LazyFlags.Destination = Destination;
+    Context->LazyFlags.Source = Source;
+    Context->LazyFlags.Result = Result;
+    Context->LazyFlags.CarryIn = CarryIn;
+}
+
+static u16 EvaluateLazyFlags(lazy_flags *Lazy)
 {
-    u8 FirstImmediateByte = ReadMemory(ReadRegister(IP) + Offset, 1);
-    if (IsWord)
+    u32 Mask = Lazy->IsWide ? 0xffff : 0xff;
+    u32 SignBit = Lazy->IsWide ? 0x8000 : 0x80;
+    u32 Destination = Lazy->Destination & Mask;
+    u32 Source = Lazy->Source & Mask;
+    u32 Result = Lazy->Result & Mask;
+    u16 Flags = 0;
+    if (Result == 0) Flags |= flag_Zero;
+    if (Result & SignBit) Flags |= flag_Sign;
+    if (OnesCount(Result & 0xff) % 2 == 0) Flags |= flag_Parity;
+    if ((Destination ^ Source ^ Result) & 0x10) Flags |= flag_Aux_Carry;
+    if (Lazy->Op == lazy_flags_op_Add)
     {
-        u8 SecondImmediateByte = ReadMemory(ReadRegister(IP) + Offset + 1, 1);
-        return ((0xff & SecondImmediateByte) << 8) | (FirstImmediateByte & 0xff);
+        if (Destination + Source + Lazy->CarryIn > Mask) Flags |= flag_Carry;
+        if ((Destination ^ Result) & (Source ^ Result) & SignBit) Flags |= flag_Overflow;
     }
     else
     {
-        return (FirstImmediateByte << 8) >> 8;
+        if (Destination < Source + Lazy->CarryIn) Flags |= flag_Carry;
+        if ((Destination ^ Source) & (Destination ^ Result) & SignBit) Flags |= flag_Overflow;
     }
+    return Flags;
 }
 
-static void SetFlag(flag Flag, s32 ShouldSet)
+static void MaterializeFlags(sim_context *Context)
 {
-    GlobalFlags = ShouldSet ? SET_FLAG(GlobalFlags, Flag) : UNSET_FLAG(GlobalFlags, Flag);
+    if (Context->LazyFlags.Op == lazy_flags_op_None) return;
+    Context->Flags = (Context->Flags & ~ARITHMETIC_FLAGS) | EvaluateLazyFlags(&Context->LazyFlags);
+    Context->LazyFlags.Op = lazy_flags_op_None;
 }
 
-static void UpdateFlags(s16 ResultValue)
+static s32 ReadFlag(sim_context *Context, flag Flag)
 {
-    SetFlag(flag_Zero, ResultValue == 0);
-    SetFlag(flag_Sign, (ResultValue & 0x8000) >> 15);
-    SetFlag(flag_Parity, OnesCount(ResultValue & 0xff) % 2 == 0);
+    if (Context->LazyFlags.Op != lazy_flags_op_None)
+    {
+        // NOTE: zero and sign are what jumps test most, and they only need the result
+        u16 Mask = Context->LazyFlags.IsWide ? 0xffff : 0xff;
+        switch(Flag)
+        {
+        case flag_Zero: return (Context->LazyFlags.Result & Mask) == 0;
+        case flag_Sign: return (Context->LazyFlags.Result & (Context->LazyFlags.IsWide ? 0x8000 : 0x80)) != 0;
+        default: MaterializeFlags(Context); break;
+        }
+    }
+    return GET_FLAG(Context->Flags, Flag);
 }
 
 static instruction_kind GetInstructionKindForArithmeticImmediateFromRegisterMemory(s16 REG)
@@ -365,658 +1035,2126 @@ static instruction_kind GetInstructionKindForArithmeticImmediateFromRegisterMemo
     }
 }
 
-static s32 GetMemoryIndexFromEffectiveAddress(effective_address EffectiveAddress, s32 Offset)
+// NOTE: branch free, the decoder has already turned the effective address into masked register indices (see SetAddressRegisters)
+static u16 GetEffectiveAddressOffset(sim_context *Context, decoded_instruction *Instruction)
 {
-    switch(EffectiveAddress)
+    return (Context->Registers[Instruction->AddressBase] & Instruction->AddressBaseMask) +
+        (Context->Registers[Instruction->AddressIndex] & Instruction->AddressIndexMask) + Instruction->Displacement;
+}
+
+/*
+  The arithmetic the memory forms share: sets *Result to Destination <Kind> Source and records the
+  flags. Returns 1 if the result has to be written back, 0 for cmp (flags only), and -1 for a kind
+  the simulator does not implement.
+*/
+static s32 SimulateArithmetic(sim_context *Context, instruction_kind Kind, s32 IsWide, u16 Destination, u16 Source, u16 *Result)
+{
+    u16 CarryIn;
+    switch(Kind)
     {
-    case eac_BX: return ReadRegister(BX);
-    case eac_BX_SI: return ReadRegister(BX) + ReadRegister(SI);
-        // NOTE: eac_BX_D8 falls through to eac_BX_D16, but maybe we need to handle byte-sized offsets differently?
-    case eac_BX_D8: case eac_BX_D16:
-        return ReadRegister(BX) + Offset;
-    case eac_BX_SI_D8: case eac_BX_SI_D16:
-        return ReadRegister(BX) + ReadRegister(SI) + Offset;
-    case eac_BX_DI_D8: case eac_BX_DI_D16:
-        return ReadRegister(BX) + ReadRegister(DI) + Offset;
-    case eac_BP_SI_D8: case eac_BP_SI_D16:
-        return ReadRegister(BP) + ReadRegister(SI) + Offset;
-    case eac_BP_DI_D8: case eac_BP_DI_D16:
-        return ReadRegister(BP) + ReadRegister(DI) + Offset;
-    case eac_BX_DI: return ReadRegister(BX) + ReadRegister(DI);
-    case eac_BP_SI: return ReadRegister(BP) + ReadRegister(SI);
-    case eac_BP_DI: return ReadRegister(BP) + ReadRegister(DI);
-    case eac_SI: return ReadRegister(SI);
-    case eac_DI: return ReadRegister(DI);
-    case eac_DIRECT_ADDRESS:
-    case eac_SI_D8: case eac_SI_D16:
-        return ReadRegister(SI) + Offset;
-    case eac_DI_D8: case eac_DI_D16:
-        return ReadRegister(DI) + Offset;
-    case eac_BP_D8: case eac_BP_D16:
-        return ReadRegister(BP) + Offset;
+    case instruction_kind_Mov:
+        *Result = Source;
+        return 1;
+    case instruction_kind_Add:
+        *Result = Destination + Source;
+        RecordFlags(Context, lazy_flags_op_Add, IsWide, Destination, Source, *Result, 0);
+        return 1;
+    case instruction_kind_Adc:
+        CarryIn = ReadFlag(Context, flag_Carry);
+        *Result = Destination + Source + CarryIn;
+        RecordFlags(Context, lazy_flags_op_Add, IsWide, Destination, Source, *Result, CarryIn);
+        return 1;
+    case instruction_kind_Sub:
+        *Result = Destination - Source;
+        RecordFlags(Context, lazy_flags_op_Sub, IsWide, Destination, Source, *Result, 0);
+        return 1;
+    case instruction_kind_Sbb:
+        CarryIn = ReadFlag(Context, flag_Carry);
+        *Result = Destination - Source - CarryIn;
+        RecordFlags(Context, lazy_flags_op_Sub, IsWide, Destination, Source, *Result, CarryIn);
+        return 1;
+    case instruction_kind_Cmp:
+        RecordFlags(Context, lazy_flags_op_Sub, IsWide, Destination, Source, Destination - Source, 0);
+        return 0;
     default:
-        printf("EffectiveAddress %s\n", GetEffectiveAddressDisplay(EffectiveAddress));
-        return ErrorMessageAndCode("GetMemoryIndexFromEffectiveAddress effective address not implemented\n", -1);
+        return -1;
     }
 }
 
-static void SetInstructionBufferIndex(s32 Index)
+static void SetInstructionBufferIndex(sim_context *Context, s32 Index)
 {
     if (Index < 0)
     {
-        printf("Invalid insutrction buffer index %d\n", Index);
+        PrintMessage("Invalid insutrction buffer index %d\n", Index);
     }
     // The IP is just the instruction-buffer's index, so we sync the writes here. Maybe at some point it would make more sense to _only_ use the IP register to read the instruction bytes.
-    WriteRegister(IP, Index);
+    WriteRegister(Context, IP, Index);
 }
 
-static s32 InitSimulation(simulation_mode Mode)
+static s32 InitSimulation(sim_context *Context)
 {
-    switch(Mode)
-    {
-        case simulation_mode_Print:
-            printf("bits 16\n");
-    default:
-        break;
-    }
+    ResetDecodeCache(Context);
+    ResetBlockCache(Context);
+    UpdateSegmentBases(Context);
+    Context->LazyFlags.Op = lazy_flags_op_None;
+    Context->InstructionCount = 0;
+    Context->JumpCount = 0;
+    Context->ClockCount = 0;
+    Context->ClockPenaltyCount = 0;
     return 0;
 }
 
-static s32 SimulateRegisterToRegister(simulation_mode Mode, opcode Opcode, s16 DestinationRegister, s16 SourceRegister)
+static void InitLengthScanTables(void);
+
+// NOTE: fills the read-only lookup tables every context shares, call it once before starting any simulation
+static void InitSimulatorTables(void)
 {
-    s16 DestinationRegisterValue = ReadRegister(DestinationRegister);
-    s16 ValueToWrite = ReadRegister(SourceRegister);
-    switch(Mode)
-    {
-    case simulation_mode_Print:
-        printf("%s %s, %s\n", DisplayInstructionKind(Opcode.InstructionKind), DisplayRegisterName(DestinationRegister), DisplayRegisterName(SourceRegister));
-        break;
-    case simulation_mode_Simulate:
+    InitJumpConditionTable();
+    InitJitTables();
+    InitDisplayTables();
+    InitLengthScanTables();
+}
+
+static sim_context *AllocateSimContext(s32 UseHugePages)
+{
+    sim_context *Context = AllocateMemory(sizeof(sim_context));
+    if (!Context) return 0;
+    Context->Memory = AllocateGuardedMemory(MEMORY_SIZE + MEMORY_SHADOW_SIZE, UseHugePages, &Context->MemoryArenaSize);
+    if (!Context->Memory)
     {
-        switch(Opcode.InstructionKind)
-        {
-        case instruction_kind_Mov:
-        {
-            WriteRegister(DestinationRegister, ValueToWrite);
-        } break;
-        case instruction_kind_Add:
+        FreeMemory(Context, sizeof(sim_context));
+        return 0;
+    }
+    return Context;
+}
+
+static void FreeSimContext(sim_context *Context)
+{
+    if (!Context) return;
+    if (Context->JitCode.Code) FreeMemory(Context->JitCode.Code, Context->JitCode.Size);
+    FreeMemory(Context->Memory, Context->MemoryArenaSize);
+    FreeMemory(Context, sizeof(sim_context));
+}
+
+static sim_snapshot *TakeSnapshot(sim_context *Context)
+{
+    s32 Page = 0;
+    u32 Start, ByteCount;
+    sim_snapshot *Snapshot = malloc(sizeof(sim_snapshot));
+    if (!Snapshot) return 0;
+    Snapshot->MemoryFile = CreateSharedMemoryFile(MEMORY_SIZE);
+    if (Snapshot->MemoryFile < 0)
+    {
+        free(Snapshot);
+        return 0;
+    }
+    // NOTE: the file starts out zero, so only the dirty pages have to be written
+    while (NextDirtyRange(Context->DirtyPages, &Page, &Start, &ByteCount))
+    {
+        if (WriteSharedMemoryFile(Snapshot->MemoryFile, Start, Context->Memory + Start, ByteCount))
+        {
+            CloseSharedMemoryFile(Snapshot->MemoryFile);
+            free(Snapshot);
+            return 0;
+        }
+    }
+    MaterializeFlags(Context);
+    memcpy(Snapshot->Registers, Context->Registers, sizeof(Snapshot->Registers));
+    Snapshot->Flags = Context->Flags;
+    memcpy(Snapshot->DirtyPages, Context->DirtyPages, sizeof(Snapshot->DirtyPages));
+    return Snapshot;
+}
+
+static void FreeSnapshot(sim_snapshot *Snapshot)
+{
+    if (!Snapshot) return;
+    CloseSharedMemoryFile(Snapshot->MemoryFile);
+    free(Snapshot);
+}
+
+// NOTE: puts Context back into the snapshot's state, dropping every page Context wrote since it was last restored
+static s32 RestoreSnapshot(sim_context *Context, sim_snapshot *Snapshot)
+{
+    if (!MapCopyOnWrite(Snapshot->MemoryFile, MEMORY_SIZE, Context->Memory))
+    {
+        return ErrorMessageAndCode("Could not map snapshot memory\n", 1);
+    }
+    memcpy(Context->Registers, Snapshot->Registers, sizeof(Context->Registers));
+    UpdateSegmentBases(Context);
+    Context->Flags = Snapshot->Flags;
+    Context->LazyFlags.Op = lazy_flags_op_None;
+    memcpy(Context->DirtyPages, Snapshot->DirtyPages, sizeof(Context->DirtyPages));
+    SyncMemoryShadow(Context);
+    return 0;
+}
+
+static sim_context *ForkSnapshot(sim_snapshot *Snapshot)
+{
+    sim_context *Context = AllocateSimContext(0);
+    if (Context && RestoreSnapshot(Context, Snapshot))
+    {
+        FreeSimContext(Context);
+        return 0;
+    }
+    return Context;
+}
+
+static s32 SimulateRegisterToRegister(sim_context *Context, decoded_instruction *Instruction)
+{
+    s16 DestinationRegister = Instruction->DestinationRegister;
+    s16 DestinationRegisterValue = ReadRegister(Context, DestinationRegister);
+    s16 ValueToWrite = ReadRegister(Context, Instruction->SourceRegister);
+    switch(Instruction->Opcode.InstructionKind)
+    {
+    case instruction_kind_Mov:
+    {
+        WriteRegister(Context, DestinationRegister, ValueToWrite);
+    } break;
+    case instruction_kind_Add:
+    {
+        RecordFlags(Context, lazy_flags_op_Add, Instruction->W, DestinationRegisterValue, ValueToWrite, DestinationRegisterValue + ValueToWrite, 0);
+        ValueToWrite = DestinationRegisterValue + ValueToWrite;
+        WriteRegister(Context, DestinationRegister, ValueToWrite);
+    } break;
+    case instruction_kind_Adc:
+    {
+        s16 CarryIn = ReadFlag(Context, flag_Carry);
+        RecordFlags(Context, lazy_flags_op_Add, Instruction->W, DestinationRegisterValue, ValueToWrite, DestinationRegisterValue + ValueToWrite + CarryIn, CarryIn);
+        ValueToWrite = DestinationRegisterValue + ValueToWrite + CarryIn;
+        WriteRegister(Context, DestinationRegister, ValueToWrite);
+    } break;
+    case instruction_kind_Sub:
+    {
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, ValueToWrite, DestinationRegisterValue - ValueToWrite, 0);
+        ValueToWrite = DestinationRegisterValue - ValueToWrite;
+        WriteRegister(Context, DestinationRegister, ValueToWrite);
+    } break;
+    case instruction_kind_Sbb:
+    {
+        s16 CarryIn = ReadFlag(Context, flag_Carry);
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, ValueToWrite, DestinationRegisterValue - ValueToWrite - CarryIn, CarryIn);
+        ValueToWrite = DestinationRegisterValue - ValueToWrite - CarryIn;
+        WriteRegister(Context, DestinationRegister, ValueToWrite);
+    } break;
+    case instruction_kind_Cmp:
+    {
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, ValueToWrite, DestinationRegisterValue - ValueToWrite, 0);
+    } break;
+    default: break;
+    }
+    return 0;
+}
+
+// NOTE: mov sreg, r/m16 gets its own op so that it is the one register write that has to move a cached segment base
+static s32 SimulateMoveToSegmentRegister(sim_context *Context, decoded_instruction *Instruction)
+{
+    u16 Value;
+    if (Instruction->MOD == 0b11) Value = ReadRegister(Context, Instruction->SourceRegister);
+    else Value = ReadMemory16(Context->Memory, Context->SegmentBases[Instruction->Segment], GetEffectiveAddressOffset(Context, Instruction));
+    WriteRegister(Context, Instruction->DestinationRegister, Value);
+    UpdateSegmentBases(Context);
+    return 0;
+}
+
+static s32 SimulateRegisterAndEffectiveAddress(sim_context *Context, decoded_instruction *Instruction)
+{
+    s16 Register = Instruction->DestinationRegister;
+    // NOTE: segment register moves have no W bit, they always move a word
+    s32 IsWide = Instruction->W || Instruction->Opcode.Kind == opcode_kind_SegmentRegister;
+    u32 SegmentBase = Context->SegmentBases[Instruction->Segment];
+    u16 Offset = GetEffectiveAddressOffset(Context, Instruction);
+    u16 MemoryValue, RegisterValue, Result;
+    s32 ShouldWrite;
+    // NOTE: D set means the register is the destination, otherwise the memory operand is
+    if (Instruction->Opcode.InstructionKind == instruction_kind_Mov)
+    {
+        if (Instruction->D) WriteRegister(Context, Register, ReadMemoryValue(Context->Memory, SegmentBase, Offset, IsWide));
+        else WriteMemoryValue(Context, SegmentBase, Offset, ReadRegister(Context, Register), IsWide);
+        return 0;
+    }
+    MemoryValue = ReadMemoryValue(Context->Memory, SegmentBase, Offset, IsWide);
+    RegisterValue = ReadRegister(Context, Register);
+    ShouldWrite = Instruction->D ?
+        SimulateArithmetic(Context, Instruction->Opcode.InstructionKind, IsWide, RegisterValue, MemoryValue, &Result) :
+        SimulateArithmetic(Context, Instruction->Opcode.InstructionKind, IsWide, MemoryValue, RegisterValue, &Result);
+    if (ShouldWrite < 0)
+    {
+        PrintMessage("InstructionKind %s\n", DisplayInstructionKind(Instruction->Opcode.InstructionKind));
+        return ErrorMessageAndCode("SimulateRegisterAndEffectiveAddress instruction kind not implemented\n", 1);
+    }
+    if (!ShouldWrite) return 0;
+    if (Instruction->D) WriteRegister(Context, Register, Result);
+    else WriteMemoryValue(Context, SegmentBase, Offset, Result, IsWide);
+    return 0;
+}
+
+static s32 SimulateImmediateToRegisterMemory(sim_context *Context, decoded_instruction *Instruction)
+{
+    s16 DestinationRegister = Instruction->DestinationRegister;
+    s16 DestinationRegisterValue = ReadRegister(Context, DestinationRegister);
+    s16 Immediate = Instruction->Immediate;
+    switch(Instruction->Opcode.InstructionKind)
+    {
+    case instruction_kind_Mov:
+    {
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Add:
+    {
+        RecordFlags(Context, lazy_flags_op_Add, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue + Immediate, 0);
+        Immediate = DestinationRegisterValue + Immediate;
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Adc:
+    {
+        s16 CarryIn = ReadFlag(Context, flag_Carry);
+        RecordFlags(Context, lazy_flags_op_Add, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue + Immediate + CarryIn, CarryIn);
+        Immediate = DestinationRegisterValue + Immediate + CarryIn;
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Sub:
+    {
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue - Immediate, 0);
+        Immediate = DestinationRegisterValue - Immediate;
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Sbb:
+    {
+        s16 CarryIn = ReadFlag(Context, flag_Carry);
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue - Immediate - CarryIn, CarryIn);
+        Immediate = DestinationRegisterValue - Immediate - CarryIn;
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Cmp:
+    {
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue - Immediate, 0);
+    } break;
+    default:
+        return ErrorMessageAndCode("SimulateImmediateToRegisterMemory unkown instruction kind!\n", 1);
+    }
+    return 0;
+}
+
+static s32 SimulateImmediateToEffectiveAddress(sim_context *Context, decoded_instruction *Instruction)
+{
+    s32 IsWide = Instruction->W;
+    u32 SegmentBase = Context->SegmentBases[Instruction->Segment];
+    u16 Offset = GetEffectiveAddressOffset(Context, Instruction);
+    u16 MemoryValue, Result;
+    s32 ShouldWrite;
+    if (Instruction->IsMove)
+    {
+        WriteMemoryValue(Context, SegmentBase, Offset, Instruction->Immediate, IsWide);
+        return 0;
+    }
+    MemoryValue = ReadMemoryValue(Context->Memory, SegmentBase, Offset, IsWide);
+    ShouldWrite = SimulateArithmetic(Context, Instruction->Opcode.InstructionKind, IsWide, MemoryValue, Instruction->Immediate, &Result);
+    if (ShouldWrite < 0) return ErrorMessageAndCode("SimulateImmediateToEffectiveAddress unknown instruction kind!\n", 1);
+    if (ShouldWrite) WriteMemoryValue(Context, SegmentBase, Offset, Result, IsWide);
+    return 0;
+}
+
+static s32 SimulateImmediateToRegister(sim_context *Context, decoded_instruction *Instruction)
+{
+    s16 DestinationRegister = Instruction->DestinationRegister;
+    s16 DestinationRegisterValue = ReadRegister(Context, DestinationRegister);
+    s16 Immediate = Instruction->Immediate;
+    switch(Instruction->Opcode.InstructionKind)
+    {
+    case instruction_kind_Mov:
+    {
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Add:
+    {
+        RecordFlags(Context, lazy_flags_op_Add, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue + Immediate, 0);
+        Immediate = DestinationRegisterValue + Immediate;
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Adc:
+    {
+        s16 CarryIn = ReadFlag(Context, flag_Carry);
+        RecordFlags(Context, lazy_flags_op_Add, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue + Immediate + CarryIn, CarryIn);
+        Immediate = DestinationRegisterValue + Immediate + CarryIn;
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Sub:
+    {
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue - Immediate, 0);
+        Immediate = DestinationRegisterValue - Immediate;
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Sbb:
+    {
+        s16 CarryIn = ReadFlag(Context, flag_Carry);
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue - Immediate - CarryIn, CarryIn);
+        Immediate = DestinationRegisterValue - Immediate - CarryIn;
+        WriteRegister(Context, DestinationRegister, Immediate);
+    } break;
+    case instruction_kind_Cmp:
+    {
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, DestinationRegisterValue, Immediate, DestinationRegisterValue - Immediate, 0);
+    } break;
+    default: break;
+    }
+    return 0;
+}
+
+static s32 SimulateJump(sim_context *Context, decoded_instruction *Instruction)
+{
+    // NOTE: IP has already been moved past the jump, so the offset is relative to the next instruction.
+    u32 Condition = Instruction->FirstByte & 0xf;
+    u16 NextIP = ReadRegister(Context, IP);
+    u16 Flags, Taken;
+    if (JumpConditionFlags[Condition] & ~(flag_Zero | flag_Sign))
+    {
+        MaterializeFlags(Context);
+        Flags = Context->Flags;
+    }
+    else
+    {
+        // NOTE: je/jne/js/jns only need the result, so the pending flags can stay pending
+        Flags = (ReadFlag(Context, flag_Zero) ? flag_Zero : 0) | (ReadFlag(Context, flag_Sign) ? flag_Sign : 0);
+    }
+    Taken = (JumpConditionTable[Condition] >> (Flags & JUMP_CONDITION_FLAGS)) & 1;
+    WriteRegister(Context, IP, NextIP + ((s8)Instruction->Immediate & -Taken));
+    Context->JumpCount += 1;
+    Context->LastJumpTaken = Taken;
+    return 0;
+}
+
+static s32 SimulateLoop(sim_context *Context, decoded_instruction *Instruction)
+{
+    /* loopnz, loopz, loop and jcxz are 0xe0 to 0xe3. The first three decrement CX and jump while it
+       is not zero, loopnz and loopz also need ZF to match. jcxz leaves CX alone and jumps when it is zero. */
+    static const u16 ZeroFlagMask[4] = {flag_Zero, flag_Zero, 0, 0};
+    static const u16 ZeroFlagValue[4] = {0, flag_Zero, 0, 0};
+    u32 Kind = Instruction->FirstByte & 0b11;
+    u16 NextIP = ReadRegister(Context, IP);
+    u16 Count = ReadRegister(Context, CX);
+    u16 Taken;
+    if (Kind == (JCXZ & 0b11))
+    {
+        Taken = Count == 0;
+    }
+    else
+    {
+        u16 Flags = ReadFlag(Context, flag_Zero) ? flag_Zero : 0;
+        Count -= 1;
+        WriteRegister(Context, CX, Count);
+        Taken = (Count != 0) & ((Flags & ZeroFlagMask[Kind]) == ZeroFlagValue[Kind]);
+    }
+    WriteRegister(Context, IP, NextIP + ((s8)Instruction->Immediate & -Taken));
+    Context->JumpCount += 1;
+    Context->LastJumpTaken = Taken;
+    return 0;
+}
+
+static s32 SimulateMemoryAccumulator(sim_context *Context, decoded_instruction *Instruction)
+{
+    register_name Accumulator = Instruction->W ? AX : AL;
+    u16 Result;
+    s32 ShouldWrite;
+    if (Instruction->IsMove)
+    {
+        // NOTE: Immediate holds the direct address, D set means the accumulator is stored to it
+        u32 SegmentBase = Context->SegmentBases[Instruction->Segment];
+        if (Instruction->D) WriteMemoryValue(Context, SegmentBase, Instruction->Immediate, ReadRegister(Context, Accumulator), Instruction->W);
+        else WriteRegister(Context, Accumulator, ReadMemoryValue(Context->Memory, SegmentBase, Instruction->Immediate, Instruction->W));
+        return 0;
+    }
+    ShouldWrite = SimulateArithmetic(Context, Instruction->Opcode.InstructionKind, Instruction->W, ReadRegister(Context, Accumulator), Instruction->Immediate, &Result);
+    if (ShouldWrite < 0) return ErrorMessageAndCode("SimulateMemoryAccumulator unknown instruction kind!\n", 1);
+    if (ShouldWrite) WriteRegister(Context, Accumulator, Result);
+    return 0;
+}
+
+/*
+  String instructions
+  ===================
+  The source is [SI] in DS (or the override segment), the destination is always [DI] in ES. After
+  each element SI and DI move by the element size, forwards or backwards depending on DF. With a
+  repeat prefix the instruction runs CX times in a single call, decrementing CX as it goes.
+*/
+
+// NOTE: one element of a string instruction, Step is the signed amount SI and DI move by
+static void SimulateStringElement(sim_context *Context, decoded_instruction *Instruction, s16 Step)
+{
+    s32 IsWide = Instruction->W;
+    register_name Accumulator = IsWide ? AX : AL;
+    u32 SourceBase = Context->SegmentBases[Instruction->Segment];
+    u32 DestinationBase = Context->SegmentBases[segment_ES];
+    u16 Source = ReadRegister(Context, SI), Destination = ReadRegister(Context, DI);
+    u16 Left, Right;
+    switch(Instruction->Opcode.InstructionKind)
+    {
+    case instruction_kind_Movs:
+        WriteMemoryValue(Context, DestinationBase, Destination, ReadMemoryValue(Context->Memory, SourceBase, Source, IsWide), IsWide);
+        WriteRegister(Context, SI, Source + Step);
+        WriteRegister(Context, DI, Destination + Step);
+        break;
+    case instruction_kind_Cmps:
+        Left = ReadMemoryValue(Context->Memory, SourceBase, Source, IsWide);
+        Right = ReadMemoryValue(Context->Memory, DestinationBase, Destination, IsWide);
+        RecordFlags(Context, lazy_flags_op_Sub, IsWide, Left, Right, Left - Right, 0);
+        WriteRegister(Context, SI, Source + Step);
+        WriteRegister(Context, DI, Destination + Step);
+        break;
+    case instruction_kind_Stos:
+        WriteMemoryValue(Context, DestinationBase, Destination, ReadRegister(Context, Accumulator), IsWide);
+        WriteRegister(Context, DI, Destination + Step);
+        break;
+    case instruction_kind_Lods:
+        WriteRegister(Context, Accumulator, ReadMemoryValue(Context->Memory, SourceBase, Source, IsWide));
+        WriteRegister(Context, SI, Source + Step);
+        break;
+    case instruction_kind_Scas:
+        Left = ReadRegister(Context, Accumulator);
+        Right = ReadMemoryValue(Context->Memory, DestinationBase, Destination, IsWide);
+        RecordFlags(Context, lazy_flags_op_Sub, IsWide, Left, Right, Left - Right, 0);
+        WriteRegister(Context, DI, Destination + Step);
+        break;
+    default: break;
+    }
+}
+
+/*
+  The physical start of the Count elements a repeated string instruction touches from Offset, or -1
+  if they wrap around the end of the segment or the end of memory. The element-by-element path
+  handles those.
+*/
+static s32 GetStringRange(u32 SegmentBase, u16 Offset, s16 Step, s32 Count)
+{
+    s32 ElementSize = Step < 0 ? -Step : Step;
+    s32 LowOffset = Step < 0 ? Offset - (Count - 1) * ElementSize : Offset;
+    if (LowOffset < 0 || LowOffset + Count * ElementSize > 0x10000) return -1;
+    if (SegmentBase + LowOffset + Count * ElementSize > MEMORY_SIZE) return -1;
+    return SegmentBase + LowOffset;
+}
+
+/*
+  rep movs and rep stos as one host memcpy or memset. Returns 0, having changed nothing, when the
+  ranges wrap or a movs source overlaps its destination; overlapping copies depend on the element
+  order, so they are left to SimulateStringElement.
+*/
+static s32 SimulateStringBulk(sim_context *Context, decoded_instruction *Instruction, s16 Step)
+{
+    instruction_kind Kind = Instruction->Opcode.InstructionKind;
+    s32 Count = (u16)ReadRegister(Context, CX);
+    s32 ByteCount = Count << Instruction->W;
+    s32 Destination, Source = 0;
+    if (!Count || (Kind != instruction_kind_Movs && Kind != instruction_kind_Stos)) return 0;
+    Destination = GetStringRange(Context->SegmentBases[segment_ES], ReadRegister(Context, DI), Step, Count);
+    if (Destination < 0) return 0;
+    if (Kind == instruction_kind_Movs)
+    {
+        Source = GetStringRange(Context->SegmentBases[Instruction->Segment], ReadRegister(Context, SI), Step, Count);
+        if (Source < 0 || (Source < Destination + ByteCount && Destination < Source + ByteCount)) return 0;
+        memcpy(Context->Memory + Destination, Context->Memory + Source, ByteCount);
+        WriteRegister(Context, SI, ReadRegister(Context, SI) + Step * Count);
+    }
+    else
+    {
+        u16 Value = ReadRegister(Context, Instruction->W ? AX : AL);
+        if (!Instruction->W || (Value & 0xff) == (Value >> 8))
+        {
+            memset(Context->Memory + Destination, Value & 0xff, ByteCount);
+        }
+        else
+        {
+            // NOTE: a two byte pattern, doubled up with memcpy from the part that is already filled
+            s32 Filled = 2;
+            StorePhysicalWord(Context->Memory, Destination, Value);
+            while (Filled < ByteCount)
+            {
+                s32 Chunk = Filled < ByteCount - Filled ? Filled : ByteCount - Filled;
+                memcpy(Context->Memory + Destination + Filled, Context->Memory + Destination, Chunk);
+                Filled += Chunk;
+            }
+        }
+    }
+    WriteRegister(Context, DI, ReadRegister(Context, DI) + Step * Count);
+    WriteRegister(Context, CX, 0);
+    CommitMemoryRange(Context, Destination, ByteCount);
+    return 1;
+}
+
+static s32 SimulateString(sim_context *Context, decoded_instruction *Instruction)
+{
+    instruction_kind Kind = Instruction->Opcode.InstructionKind;
+    s32 ChecksZero = Kind == instruction_kind_Cmps || Kind == instruction_kind_Scas;
+    // NOTE: DF is never pending in LazyFlags, so Flags always has it
+    s16 Step = (Context->Flags & flag_Direction ? -1 : 1) << Instruction->W;
+    u16 Count;
+    if (!Instruction->RepeatPrefix)
+    {
+        SimulateStringElement(Context, Instruction, Step);
+        return 0;
+    }
+    if (Context->UseBulkStrings && SimulateStringBulk(Context, Instruction, Step)) return 0;
+    for (Count = ReadRegister(Context, CX); Count != 0;)
+    {
+        SimulateStringElement(Context, Instruction, Step);
+        Count -= 1;
+        // NOTE: repe stops once ZF is clear, repne once it is set
+        if (ChecksZero && ReadFlag(Context, flag_Zero) != (Instruction->RepeatPrefix == REP_PREFIX)) break;
+    }
+    WriteRegister(Context, CX, Count);
+    return 0;
+}
+
+// NOTE: cld and std
+static s32 SimulateFlagControl(sim_context *Context, decoded_instruction *Instruction)
+{
+    if (Instruction->Opcode.InstructionKind == instruction_kind_Std) Context->Flags |= flag_Direction;
+    else Context->Flags &= ~flag_Direction;
+    return 0;
+}
+
+static s32 SimulateHalt(sim_context *Context, decoded_instruction *Instruction)
+{
+    // NOTE: HALT leaves IP pointing at itself, which makes it easier to check with the reference simulator
+    SetInstructionBufferIndex(Context, ReadRegister(Context, IP) - Instruction->Length);
+    return SIMULATE_HALTED;
+}
+
+static s32 FormatByteInBinary(char *Output, u8 Byte)
+{
+    s32 I;
+    Output[0] = ' ';
+    for (I = 7; I >= 0; --I)
+    {
+        Output[8 - I] = '0' + ((Byte >> I) & 0b1);
+    }
+    Output[9] = ' ';
+    Output[10] = 0;
+    return 10;
+}
+
+// NOTE: the register dump the simulate mode prints, written to Output instead of stdout
+static s32 FormatRegisters(sim_context *Context, char *Output, s32 OutputSize)
+{
+    char *NameMap[] = {"AX", "BX", "CX", "DX", "SP", "BP", "SI", "DI", "CS", "DS", "SS", "ES", "IP"};
+    char FlagBits[32];
+    s32 I, Used = 0;
+    MaterializeFlags(Context);
+    Used += snprintf(Output + Used, OutputSize - Used, "----------------------\nRegisters:\n");
+    for (I = 0; I < REGISTER_COUNT && Used < OutputSize; ++I)
+    {
+        if (Context->Registers[I]) Used += snprintf(Output + Used, OutputSize - Used, "  %s %0004x \n", NameMap[I], Context->Registers[I]);
+    }
+    FormatByteInBinary(FlagBits, 0xff & (Context->Flags >> 8));
+    FormatByteInBinary(FlagBits + 10, 0xff & Context->Flags);
+    if (Used < OutputSize) Used += snprintf(Output + Used, OutputSize - Used, "\nFlags:           DIOSZAPC\n      %s\n", FlagBits);
+    return Used < OutputSize ? Used : OutputSize - 1;
+}
+
+static void DEBUG_PrintRegisters(sim_context *Context)
+{
+    char Output[512];
+    FormatRegisters(Context, Output, sizeof(Output));
+    fputs(Output, stdout);
+}
+
+/*
+  Decoding
+  ========
+  DecodeInstruction only reads instruction bytes out of Memory; it never touches registers, flags or
+  the decode cache. The print back end (PrintInstruction) and the simulate back end (the Simulate*
+  functions) both consume the decoded_instruction it fills in.
+*/
+
+/*
+  Turns the instruction's effective address into its address-generation form: a register that is not
+  part of the address is read through a zero mask, so computing the offset needs no branches.
+*/
+static void SetAddressForm(decoded_instruction *Instruction)
+{
+    address_form *Form = &AddressFormTable[Instruction->EffectiveAddress];
+    if (Form->Base != ADDRESS_NO_REGISTER)
+    {
+        Instruction->AddressBase = RegisterIndexTable[Form->Base];
+        Instruction->AddressBaseMask = 0xffff;
+    }
+    if (Form->Index != ADDRESS_NO_REGISTER)
+    {
+        Instruction->AddressIndex = RegisterIndexTable[Form->Index];
+        Instruction->AddressIndexMask = 0xffff;
+    }
+    Instruction->Segment = Form->DefaultSegment;
+}
+static s32 DecodeInstruction(u8 *Memory, u32 CodeBase, u16 InstructionPointer, decoded_instruction *Instruction)
+{
+    u8 FirstByte = ReadInstructionByte(Memory, CodeBase, InstructionPointer, 0);
+    opcode_dispatch *Dispatch;
+    opcode Opcode;
+    s16 MOD = 0, REG = 0, RM = 0, OverrideSegment = -1;
+    u8 RepeatPrefix = 0;
+    s32 PrefixLength = 0;
+    // NOTE: at most one prefix of each kind, in either order. The rest is decoded relative to the byte after the prefixes, so every offset below stays the same
+    for (;;)
+    {
+        if (OverrideSegment < 0 && IS_SEGMENT_OVERRIDE_PREFIX(FirstByte)) OverrideSegment = GET_SEGMENT_OVERRIDE(FirstByte);
+        else if (!RepeatPrefix && IS_REPEAT_PREFIX(FirstByte)) RepeatPrefix = FirstByte;
+        else break;
+        InstructionPointer += 1;
+        PrefixLength += 1;
+        FirstByte = ReadInstructionByte(Memory, CodeBase, InstructionPointer, 0);
+    }
+    Dispatch = &OpcodeDispatchTable[FirstByte];
+    Opcode = Dispatch->Opcode;
+    memset(Instruction, 0, sizeof(*Instruction));
+    Instruction->FirstByte = FirstByte;
+    Instruction->Op = Dispatch->Op;
+    Instruction->Length = 2; /* we just guess that Length is 2 and update it in places where it is not */
+    if (Dispatch->Flags & opcode_flag_D) Instruction->D = GET_D(FirstByte);
+    if (Dispatch->Flags & opcode_flag_W) Instruction->W = GET_W(FirstByte);
+    if (Dispatch->Flags & opcode_flag_RegW)
+    {
+        REG = GET_IMMEDIATE_TO_REGISTER_REG(FirstByte);
+        Instruction->W = GET_IMMEDIATE_TO_REGISTER_W(FirstByte);
+    }
+    if (Dispatch->Flags & opcode_flag_ModRM)
+    {
+        u8 SecondByte = ReadInstructionByte(Memory, CodeBase, InstructionPointer, 1);
+        MOD = GET_MOD(SecondByte);
+        REG = GET_REG(SecondByte);
+        RM = GET_RM(SecondByte);
+        Instruction->MOD = MOD;
+        if (MOD != 0b11) Instruction->Op = Dispatch->MemoryOp;
+    }
+    switch(Opcode.Kind)
+    {
+    case opcode_kind_SegmentRegister:
+    case opcode_kind_RegisterMemoryToFromRegister:
+    {
+        s32 IsSegment = Opcode.Kind == opcode_kind_SegmentRegister;
+        if(MOD == 0b11)
+        {
+            s16 RegIndex = IsSegment ? SegmentRegisterTable[(REG & 0b11)] : RegTable[REG][Instruction->W];
+            s32 RmIsWide = IsSegment || Instruction->W;
+            s16 RmIndex = RegTable[RM][RmIsWide];
+            Instruction->DestinationRegister = Instruction->D ? RegIndex : RmIndex;
+            Instruction->SourceRegister      = Instruction->D ? RmIndex  : RegIndex;
+        }
+        else
+        {
+            Instruction->DestinationRegister = GetRegisterIndex(REG, Instruction->W, IsSegment);
+            Instruction->EffectiveAddress = EffectiveAddressCalculationTable[MOD][RM];
+            if (MOD == 0b01 || MOD == 0b10)
+            {
+                Instruction->Length = MOD == 0b10 ? 4 : 3;
+                Instruction->IsWideDisplacement = MOD == 0b10;
+                Instruction->Displacement = GetImmediate(Memory, CodeBase, InstructionPointer, 2, MOD == 0b10, MOD == 0b01);
+            }
+            else if (Instruction->EffectiveAddress == eac_DIRECT_ADDRESS)
+            {
+                // NOTE: MOD == 0b00
+                Instruction->IsDirectAddress = 1;
+                Instruction->Displacement = GetImmediate(Memory, CodeBase, InstructionPointer, 2, 1, 0);
+                Instruction->Length = 4;
+            }
+        }
+    } break;
+    case opcode_kind_ImmediateToRegisterMemory:
+    {
+        s32 IsMove = Opcode.InstructionKind == instruction_kind_Mov;
+        s32 IsMoveAndWideData = IsMove && Instruction->W;
+        s32 IsWideData = IsMoveAndWideData || (!IsMove && !Instruction->D && Instruction->W);
+        // NOTE: D is the S bit here, S=1 W=1 (0x83) takes one byte and sign-extends it to a word
+        s32 IsSignExtended = !IsMove && Instruction->D && Instruction->W;
+        Instruction->IsMove = IsMove;
+        Instruction->IsWideData = IsWideData;
+        if (Opcode.InstructionKind == instruction_kind_Derived)
+        {
+            Opcode.InstructionKind = GetInstructionKindForArithmeticImmediateFromRegisterMemory(REG);
+        }
+        if(MOD == 0b11)
+        {
+            Instruction->Length = IsWideData ? 4 : 3;
+            Instruction->Immediate = GetImmediate(Memory, CodeBase, InstructionPointer, 2, IsWideData, IsSignExtended);
+            Instruction->DestinationRegister = RegTable[RM][Instruction->W];
+        }
+        else
+        {
+            Instruction->EffectiveAddress = EffectiveAddressCalculationTable[MOD][RM];
+            if (MOD == 0b01 || MOD == 0b10)
+            {
+                s16 IsWideDisplacement = MOD == 0b10;
+                if (MOD == 0b01)
+                {
+                    Instruction->Length = IsWideData ? 5 : 4;
+                }
+                else
+                {
+                    Instruction->Length = IsWideData ? 6 : 5;
+                }
+                Instruction->IsWideDisplacement = IsWideDisplacement;
+                Instruction->Displacement = GetImmediate(Memory, CodeBase, InstructionPointer, 2, IsWideDisplacement, MOD == 0b01);
+                Instruction->Immediate = GetImmediate(Memory, CodeBase, InstructionPointer, IsWideDisplacement ? 4 : 3, IsWideData, IsSignExtended);
+            }
+            else
+            {
+                // MOD == 0b00
+                Instruction->Immediate = GetImmediate(Memory, CodeBase, InstructionPointer, 2, IsWideData, IsSignExtended);
+                Instruction->Length = IsWideData ? 4 : 3;
+                if (Instruction->EffectiveAddress == eac_DIRECT_ADDRESS)
+                {
+                    Instruction->IsDirectAddress = 1;
+                    Instruction->Displacement = GetImmediate(Memory, CodeBase, InstructionPointer, 2, 1, 0);
+                    Instruction->Immediate = GetImmediate(Memory, CodeBase, InstructionPointer, 4, IsWideData, IsSignExtended);
+                    Instruction->Length = IsWideData ? 6 : 5;
+                }
+            }
+        }
+    } break;
+    case opcode_kind_ImmediateToRegister:
+    {
+        Instruction->DestinationRegister = RegTable[REG][Instruction->W];
+        Instruction->Immediate = GetImmediate(Memory, CodeBase, InstructionPointer, 1, Instruction->W, 0);
+        Instruction->Length = Instruction->W ? 3 : 2;
+    } break;
+    case opcode_kind_MemoryAccumulator:
+    {
+        s32 IsMove = Opcode.InstructionKind == instruction_kind_Mov;
+        s32 IsWideData = IsMove || Instruction->W;
+        Instruction->IsMove = IsMove;
+        Instruction->IsWideData = IsWideData;
+        Instruction->Length = IsWideData ? 3 : 2;
+        Instruction->Immediate = GetImmediate(Memory, CodeBase, InstructionPointer, 1, IsWideData, 0);
+    } break;
+    case opcode_kind_Jump:
+    {
+        Instruction->Immediate = GetImmediate(Memory, CodeBase, InstructionPointer, 1, 0, 1);
+        Instruction->Length = 2;
+    } break;
+    case opcode_kind_Halt:
+    case opcode_kind_String:
+    case opcode_kind_FlagControl:
+        Instruction->Length = 1;
+        break;
+    default:
+    {
+        char Message[64];
+        snprintf(Message, sizeof(Message), "DecodeInstruction unknown opcode %02x\n", FirstByte);
+        return ErrorMessageAndCode(Message, -1);
+    }
+    }
+    Instruction->Opcode = Opcode;
+    Instruction->Simulate = SimulateHandlerTable[Instruction->Op];
+    SetAddressForm(Instruction);
+    if (OverrideSegment >= 0)
+    {
+        Instruction->Segment = OverrideSegment;
+        Instruction->HasSegmentOverride = 1;
+    }
+    Instruction->RepeatPrefix = RepeatPrefix;
+    Instruction->Length += PrefixLength;
+    return 0;
+}
+
+static decoded_instruction *FetchDecodedInstruction(sim_context *Context, u16 InstructionPointer)
+{
+    decoded_instruction *Instruction = &Context->DecodeCache[InstructionPointer];
+    if (Context->DecodeCacheIsValid[InstructionPointer])
+    {
+        Context->DecodeCacheStats.Hits += 1;
+        return Instruction;
+    }
+    Context->DecodeCacheStats.Misses += 1;
+    if (DecodeInstruction(Context->Memory, Context->SegmentBases[segment_CS], InstructionPointer, Instruction)) return 0;
+    Context->DecodeCacheIsValid[InstructionPointer] = 1;
+    MarkCodeBytes(Context, InstructionPointer, Instruction->Length, CODE_BYTE_DECODED);
+    return Instruction;
+}
+
+/*
+  Superinstructions
+  =================
+  Guest loops are mostly a few register instructions closing with a compare and a branch. The block
+  translator replaces the Simulate handler of the first instruction of such a sequence with a fused
+  handler that runs the whole sequence in one call and sets FusedCount so the block interpreter
+  skips the rest. Every instruction a fused handler runs has a register destination, so no fused
+  sequence can write memory and none can invalidate its own block part way through. The results
+  are the same as running the instructions one by one; the only work left out is recording the
+  flags of an add or sub that the compare right after it overwrites.
+*/
+
+// NOTE: mov, add, sub and cmp with a register destination: reg/reg, reg/immediate and reg <- memory
+static s32 IsFusableRegisterInstruction(decoded_instruction *Instruction)
+{
+    s32 IsRegisterDestination = Instruction->Op == simulate_op_RegisterToRegister ||
+        Instruction->Op == simulate_op_ImmediateToRegisterMemory ||
+        Instruction->Op == simulate_op_ImmediateToRegister ||
+        (Instruction->Op == simulate_op_RegisterAndEffectiveAddress && Instruction->D &&
+         Instruction->Opcode.Kind == opcode_kind_RegisterMemoryToFromRegister);
+    switch(Instruction->Opcode.InstructionKind)
+    {
+    case instruction_kind_Mov: case instruction_kind_Add:
+    case instruction_kind_Sub: case instruction_kind_Cmp:
+        return IsRegisterDestination;
+    default:
+        return 0;
+    }
+}
+
+static s32 IsFusableKind(decoded_instruction *Instruction, instruction_kind Kind)
+{
+    return IsFusableRegisterInstruction(Instruction) && Instruction->Opcode.InstructionKind == Kind;
+}
+
+static u16 ReadFusedSource(sim_context *Context, decoded_instruction *Instruction)
+{
+    switch(Instruction->Op)
+    {
+    case simulate_op_RegisterToRegister: return ReadRegister(Context, Instruction->SourceRegister);
+    case simulate_op_RegisterAndEffectiveAddress:
+        return ReadMemoryValue(Context->Memory, Context->SegmentBases[Instruction->Segment], GetEffectiveAddressOffset(Context, Instruction), Instruction->W);
+    default: return Instruction->Immediate;
+    }
+}
+
+// NOTE: one IsFusableRegisterInstruction instruction, leaving its flags unrecorded when ShouldRecordFlags is zero
+static void SimulateFusedRegisterInstruction(sim_context *Context, decoded_instruction *Instruction, s32 ShouldRecordFlags)
+{
+    s16 Register = Instruction->DestinationRegister;
+    u16 Destination = ReadRegister(Context, Register);
+    u16 Source = ReadFusedSource(Context, Instruction);
+    u16 Result;
+    switch(Instruction->Opcode.InstructionKind)
+    {
+    case instruction_kind_Mov:
+        WriteRegister(Context, Register, Source);
+        break;
+    case instruction_kind_Add:
+        Result = Destination + Source;
+        if (ShouldRecordFlags) RecordFlags(Context, lazy_flags_op_Add, Instruction->W, Destination, Source, Result, 0);
+        WriteRegister(Context, Register, Result);
+        break;
+    case instruction_kind_Sub:
+        Result = Destination - Source;
+        if (ShouldRecordFlags) RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, Destination, Source, Result, 0);
+        WriteRegister(Context, Register, Result);
+        break;
+    case instruction_kind_Cmp:
+        RecordFlags(Context, lazy_flags_op_Sub, Instruction->W, Destination, Source, Destination - Source, 0);
+        break;
+    default: break;
+    }
+}
+
+// NOTE: the block interpreter has already moved IP past the first instruction, this moves it past the others
+static void AdvanceFusedIP(sim_context *Context, s32 ByteCount)
+{
+    WriteRegister(Context, IP, ReadRegister(Context, IP) + ByteCount);
+}
+
+static s32 SimulateFusedArithmeticCompareJump(sim_context *Context, decoded_instruction *Instruction)
+{
+    decoded_instruction *Compare = Instruction + 1, *Jump = Instruction + 2;
+    Context->FusionStats.Executions[fusion_ArithmeticCompareJump] += 1;
+    SimulateFusedRegisterInstruction(Context, Instruction, 0);
+    SimulateFusedRegisterInstruction(Context, Compare, 1);
+    AdvanceFusedIP(Context, Compare->Length + Jump->Length);
+    return SimulateJump(Context, Jump);
+}
+
+static s32 SimulateFusedArithmeticJump(sim_context *Context, decoded_instruction *Instruction)
+{
+    decoded_instruction *Jump = Instruction + 1;
+    Context->FusionStats.Executions[fusion_ArithmeticJump] += 1;
+    SimulateFusedRegisterInstruction(Context, Instruction, 1);
+    AdvanceFusedIP(Context, Jump->Length);
+    return SimulateJump(Context, Jump);
+}
+
+static s32 SimulateFusedRegisterLoop(sim_context *Context, decoded_instruction *Instruction)
+{
+    decoded_instruction *Loop = Instruction + 1;
+    Context->FusionStats.Executions[fusion_RegisterLoop] += 1;
+    SimulateFusedRegisterInstruction(Context, Instruction, 1);
+    AdvanceFusedIP(Context, Loop->Length);
+    return SimulateLoop(Context, Loop);
+}
+
+static s32 SimulateFusedMoveArithmetic(sim_context *Context, decoded_instruction *Instruction)
+{
+    decoded_instruction *Arithmetic = Instruction + 1;
+    Context->FusionStats.Executions[fusion_MoveArithmetic] += 1;
+    SimulateFusedRegisterInstruction(Context, Instruction, 0);
+    SimulateFusedRegisterInstruction(Context, Arithmetic, 1);
+    AdvanceFusedIP(Context, Arithmetic->Length);
+    return 0;
+}
+
+static char *FusionNameTable[fusion_Count] = {
+    [fusion_ArithmeticCompareJump] = "add/sub + cmp + jcc",
+    [fusion_ArithmeticJump] = "add/sub/cmp + jcc",
+    [fusion_RegisterLoop] = "mov/add/sub/cmp + loop",
+    [fusion_MoveArithmetic] = "mov + add/sub",
+};
+
+static simulate_handler *FusionHandlerTable[fusion_Count] = {
+    [fusion_ArithmeticCompareJump] = SimulateFusedArithmeticCompareJump,
+    [fusion_ArithmeticJump] = SimulateFusedArithmeticJump,
+    [fusion_RegisterLoop] = SimulateFusedRegisterLoop,
+    [fusion_MoveArithmetic] = SimulateFusedMoveArithmetic,
+};
+
+static s32 FusionLengthTable[fusion_Count] = {
+    [fusion_ArithmeticCompareJump] = 3,
+    [fusion_ArithmeticJump] = 2,
+    [fusion_RegisterLoop] = 2,
+    [fusion_MoveArithmetic] = 2,
+};
+
+// NOTE: the longest sequence that starts at Instructions[0] wins, Remaining counts Instructions[0] as well
+static fusion_kind MatchFusion(decoded_instruction *Instructions, s32 Remaining)
+{
+    decoded_instruction *First = Instructions;
+    s32 IsArithmetic = IsFusableKind(First, instruction_kind_Add) || IsFusableKind(First, instruction_kind_Sub);
+    if (Remaining >= 3 && IsArithmetic && IsFusableKind(First + 1, instruction_kind_Cmp) && First[2].Op == simulate_op_Jump)
+    {
+        return fusion_ArithmeticCompareJump;
+    }
+    if (Remaining < 2) return fusion_None;
+    if ((IsArithmetic || IsFusableKind(First, instruction_kind_Cmp)) && First[1].Op == simulate_op_Jump) return fusion_ArithmeticJump;
+    if (IsFusableRegisterInstruction(First) && First[1].Op == simulate_op_Loop) return fusion_RegisterLoop;
+    if (IsFusableKind(First, instruction_kind_Mov) && (IsFusableKind(First + 1, instruction_kind_Add) || IsFusableKind(First + 1, instruction_kind_Sub)))
+    {
+        return fusion_MoveArithmetic;
+    }
+    return fusion_None;
+}
+
+static void FuseBlockInstructions(sim_context *Context, decoded_instruction *Instructions, s32 InstructionCount)
+{
+    s32 I = 0;
+    while (I < InstructionCount)
+    {
+        fusion_kind Fusion = MatchFusion(Instructions + I, InstructionCount - I);
+        if (Fusion == fusion_None)
         {
-            ValueToWrite = DestinationRegisterValue + ValueToWrite;
-            UpdateFlags(ValueToWrite);
-            WriteRegister(DestinationRegister, ValueToWrite);
-        } break;
-        case instruction_kind_Adc:
+            I += 1;
+            continue;
+        }
+        Instructions[I].Simulate = FusionHandlerTable[Fusion];
+        Instructions[I].FusedCount = FusionLengthTable[Fusion];
+        Context->FusionStats.Sites[Fusion] += 1;
+        I += FusionLengthTable[Fusion];
+    }
+}
+
+static void PrintFusionStats(sim_context *Context)
+{
+    s32 I;
+    printf("\nFusion report:\n");
+    for (I = fusion_None + 1; I < fusion_Count; ++I)
+    {
+        printf("  %s: %llu sites, %llu executions\n", FusionNameTable[I],
+               (unsigned long long)Context->FusionStats.Sites[I], (unsigned long long)Context->FusionStats.Executions[I]);
+    }
+}
+
+static translated_block *TranslateBlock(sim_context *Context, u16 StartIP)
+{
+    s32 InstructionCount = 0, ByteLength = 0;
+    translated_block *Block;
+    decoded_instruction *Instructions;
+    if (Context->BlockCount == MAX_BLOCK_COUNT || Context->BlockInstructionPoolUsed + MAX_BLOCK_LENGTH > BLOCK_INSTRUCTION_POOL_SIZE)
+    {
+        FlushBlockCache(Context);
+        Context->BlockCacheStats.Flushes += 1;
+    }
+    Instructions = Context->BlockInstructionPool + Context->BlockInstructionPoolUsed;
+    while (InstructionCount < MAX_BLOCK_LENGTH)
+    {
+        decoded_instruction *Instruction = Instructions + InstructionCount;
+        if (DecodeInstruction(Context->Memory, Context->SegmentBases[segment_CS], StartIP + ByteLength, Instruction))
         {
-            ValueToWrite = DestinationRegisterValue + ValueToWrite;
-            UpdateFlags(ValueToWrite);
-            WriteRegister(DestinationRegister, ValueToWrite);
-        } break;
-        case instruction_kind_Sub:
+            // NOTE: the block stops in front of an undecodable instruction, so the error is reported when it is reached
+            if (InstructionCount == 0) return 0;
+            break;
+        }
+        InstructionCount += 1;
+        ByteLength += Instruction->Length;
+        if (Instruction->Op == simulate_op_Jump || Instruction->Op == simulate_op_Loop || Instruction->Op == simulate_op_Halt) break;
+        if (ByteLength + MAX_INSTRUCTION_LENGTH > DECODE_CACHE_SIZE) break;
+    }
+    if (Context->UseFusion) FuseBlockInstructions(Context, Instructions, InstructionCount);
+    Block = &Context->Blocks[Context->BlockCount];
+    Block->StartIP = StartIP;
+    Block->ByteLength = ByteLength;
+    Block->InstructionCount = InstructionCount;
+    Block->IsValid = 1;
+    Block->Instructions = Instructions;
+    Block->ExecutionCount = 0;
+    Block->JitState = jit_state_Cold;
+    Block->JitFunction = 0;
+    Context->BlockCount += 1;
+    Context->BlockInstructionPoolUsed += InstructionCount;
+    Context->BlockIndexByIP[StartIP] = Context->BlockCount;
+    MarkCodeBytes(Context, StartIP, ByteLength, CODE_BYTE_TRANSLATED);
+    Context->BlockCacheStats.BlocksTranslated += 1;
+    Context->BlockCacheStats.InstructionsTranslated += InstructionCount;
+    return Block;
+}
+
+static translated_block *FetchTranslatedBlock(sim_context *Context, u16 InstructionPointer)
+{
+    s32 BlockIndex = Context->BlockIndexByIP[InstructionPointer];
+    if (BlockIndex) return &Context->Blocks[BlockIndex - 1];
+    return TranslateBlock(Context, InstructionPointer);
+}
+
+static void PrintBlockCacheStats(sim_context *Context)
+{
+    block_cache_stats Stats = Context->BlockCacheStats;
+    printf("\nBlock cache:\n  blocks translated %llu\n  blocks executed %llu\n  invalidations %llu\n  flushes %llu\n",
+           (unsigned long long)Stats.BlocksTranslated, (unsigned long long)Stats.BlocksExecuted,
+           (unsigned long long)Stats.Invalidations, (unsigned long long)Stats.Flushes);
+    if (Stats.BlocksTranslated) printf("  average block length %.2f instructions\n", (f64)Stats.InstructionsTranslated / (f64)Stats.BlocksTranslated);
+}
+
+static void PrintDecodeCacheStats(sim_context *Context)
+{
+    decode_cache_stats Stats = Context->DecodeCacheStats;
+    u64 Lookups = Stats.Hits + Stats.Misses;
+    printf("\nDecode cache:\n  hits %llu\n  misses %llu\n  invalidations %llu\n",
+           (unsigned long long)Stats.Hits, (unsigned long long)Stats.Misses, (unsigned long long)Stats.Invalidations);
+    if (Lookups) printf("  hit rate %.2f%%\n", 100.0 * (double)Stats.Hits / (double)Lookups);
+}
+
+/*
+  Output writer
+  =============
+  The disassembler formats into one large buffer and only calls into the operating system when the
+  buffer is full or the listing is done. PrintInstruction reserves MAX_INSTRUCTION_TEXT bytes once per
+  instruction, so the Write* helpers below copy without checking for room. A writer with no file
+  (OUTPUT_TO_MEMORY) grows its buffer instead of flushing it, the parallel disassembler formats each
+  chunk into one and stitches them together afterwards.
+*/
+#define OUTPUT_WRITER_SIZE (1 << 20)
+#define OUTPUT_TO_MEMORY -1
+// NOTE: the longest line is a mov of an immediate to [es:bx + si + -32768], well below this
+#define MAX_INSTRUCTION_TEXT 128
+
+static s32 InitOutputWriter(output_writer *Writer, s32 File)
+{
+    Writer->Data = malloc(OUTPUT_WRITER_SIZE);
+    Writer->Size = OUTPUT_WRITER_SIZE;
+    Writer->Used = 0;
+    Writer->File = File;
+    Writer->HasFailed = 0;
+    if (!Writer->Data) return ErrorMessageAndCode("Could not allocate the output buffer\n", 1);
+    // NOTE: anything printf still holds has to go out before the first write of ours
+    if (File != OUTPUT_TO_MEMORY) fflush(stdout);
+    return 0;
+}
+
+static void FlushOutputWriter(output_writer *Writer)
+{
+    if (Writer->File == OUTPUT_TO_MEMORY) return;
+    if (Writer->Used && WriteFileBytes(Writer->File, Writer->Data, Writer->Used)) Writer->HasFailed = 1;
+    Writer->Used = 0;
+}
+
+static s32 FreeOutputWriter(output_writer *Writer)
+{
+    FlushOutputWriter(Writer);
+    free(Writer->Data);
+    Writer->Data = 0;
+    return Writer->HasFailed ? ErrorMessageAndCode("Could not write the output\n", 1) : 0;
+}
+
+static void ReserveOutput(output_writer *Writer, s32 ByteCount)
+{
+    if (Writer->Used + ByteCount <= Writer->Size) return;
+    if (Writer->File != OUTPUT_TO_MEMORY) FlushOutputWriter(Writer);
+    else
+    {
+        char *Data = Writer->Size <= 0x3fffffff ? realloc(Writer->Data, 2 * (size)Writer->Size) : 0;
+        // NOTE: keeps the old buffer and drops what it held, the caller sees HasFailed and gives up on the output
+        if (!Data)
         {
-            ValueToWrite = DestinationRegisterValue - ValueToWrite;
-            UpdateFlags(ValueToWrite);
-            WriteRegister(DestinationRegister, ValueToWrite);
-        } break;
-        case instruction_kind_Sbb:
+            Writer->HasFailed = 1;
+            Writer->Used = 0;
+            return;
+        }
+        Writer->Data = Data;
+        Writer->Size *= 2;
+    }
+}
+
+// NOTE: for copies of any size, a copy too big for the buffer goes straight to the file
+static void WriteOutputBytes(output_writer *Writer, char *Bytes, s32 ByteCount)
+{
+    if (Writer->Used + ByteCount > Writer->Size)
+    {
+        FlushOutputWriter(Writer);
+        if (ByteCount > Writer->Size)
         {
-            ValueToWrite = DestinationRegisterValue - ValueToWrite;
-            UpdateFlags(ValueToWrite);
-            WriteRegister(DestinationRegister, ValueToWrite);
-        } break;
-        case instruction_kind_Cmp:
+            if (WriteFileBytes(Writer->File, Bytes, ByteCount)) Writer->HasFailed = 1;
+            return;
+        }
+    }
+    memcpy(Writer->Data + Writer->Used, Bytes, ByteCount);
+    Writer->Used += ByteCount;
+}
+
+static void WriteBytes(output_writer *Writer, char *Bytes, s32 ByteCount)
+{
+    memcpy(Writer->Data + Writer->Used, Bytes, ByteCount);
+    Writer->Used += ByteCount;
+}
+
+static void WriteChar(output_writer *Writer, char Char)
+{
+    Writer->Data[Writer->Used++] = Char;
+}
+
+static void WriteText(output_writer *Writer, display_text *Text)
+{
+    WriteBytes(Writer, Text->Data, Text->Length);
+}
+
+// NOTE: the same digits as printf("%d")
+static void WriteDecimal(output_writer *Writer, s32 Value)
+{
+    char Digits[12];
+    char *End = Digits + sizeof(Digits), *Start = End;
+    u32 Magnitude = Value < 0 ? 0u - (u32)Value : (u32)Value;
+    while (Magnitude >= 100)
+    {
+        Start -= 2;
+        memcpy(Start, DecimalPairTable + 2 * (Magnitude % 100), 2);
+        Magnitude /= 100;
+    }
+    if (Magnitude >= 10)
+    {
+        Start -= 2;
+        memcpy(Start, DecimalPairTable + 2 * Magnitude, 2);
+    }
+    else *--Start = '0' + Magnitude;
+    if (Value < 0) *--Start = '-';
+    WriteBytes(Writer, Start, (s32)(End - Start));
+}
+
+// NOTE: an override is printed inside the brackets, [es:bx + si]
+static void WriteEffectiveAddress(output_writer *Writer, decoded_instruction *Instruction)
+{
+    WriteChar(Writer, '[');
+    if (Instruction->HasSegmentOverride) WriteText(Writer, &SegmentPrefixText[Instruction->Segment]);
+    if (Instruction->IsDirectAddress)
+    {
+        WriteDecimal(Writer, Instruction->Displacement);
+        WriteChar(Writer, ']');
+        return;
+    }
+    WriteText(Writer, &EffectiveAddressText[Instruction->EffectiveAddress]);
+    if (Instruction->MOD == 0b01 || Instruction->MOD == 0b10)
+    {
+        WriteChar(Writer, ' ');
+        WriteDecimal(Writer, Instruction->Displacement);
+        WriteChar(Writer, ']');
+    }
+}
+
+static void WriteRegisterOperands(output_writer *Writer, display_text *First, display_text *Second)
+{
+    WriteText(Writer, First);
+    WriteBytes(Writer, ", ", 2);
+    WriteText(Writer, Second);
+}
+
+static s32 PrintInstruction(output_writer *Writer, decoded_instruction *Instruction)
+{
+    display_text *DestinationText = &RegisterNameText[Instruction->DestinationRegister];
+    s16 Immediate = Instruction->Immediate;
+    ReserveOutput(Writer, MAX_INSTRUCTION_TEXT);
+    switch(Instruction->Opcode.Kind)
+    {
+    case opcode_kind_Halt:
+        // NOTE: DisassembleInstructions stops before the HLT that LoadProgram appends, only a stream prints it
+        WriteBytes(Writer, "hlt\n", 4);
+        return 0;
+    case opcode_kind_Jump:
+        WriteText(Writer, &JumpNameText[Instruction->FirstByte]);
+        WriteBytes(Writer, " $+2+", 5);
+        WriteDecimal(Writer, (s8)Immediate);
+        WriteChar(Writer, '\n');
+        return 0;
+    case opcode_kind_String:
+    {
+        // NOTE: NASM takes a segment register as a prefix, "es rep movsb"
+        instruction_kind Kind = Instruction->Opcode.InstructionKind;
+        if (Instruction->HasSegmentOverride)
+        {
+            WriteText(Writer, &RegisterNameText[SegmentRegisterTable[Instruction->Segment]]);
+            WriteChar(Writer, ' ');
+        }
+        if (Instruction->RepeatPrefix == REPNE_PREFIX) WriteBytes(Writer, "repne ", 6);
+        else if (Instruction->RepeatPrefix == REP_PREFIX)
+        {
+            if (Kind == instruction_kind_Cmps || Kind == instruction_kind_Scas) WriteBytes(Writer, "repe ", 5);
+            else WriteBytes(Writer, "rep ", 4);
+        }
+        WriteText(Writer, &InstructionKindText[Kind]);
+        WriteChar(Writer, Instruction->W ? 'w' : 'b');
+        WriteChar(Writer, '\n');
+        return 0;
+    }
+    case opcode_kind_SegmentRegister:
+    case opcode_kind_RegisterMemoryToFromRegister:
+    case opcode_kind_ImmediateToRegisterMemory:
+    case opcode_kind_ImmediateToRegister:
+    case opcode_kind_MemoryAccumulator:
+    case opcode_kind_FlagControl:
+        break;
+    default:
+        FlushOutputWriter(Writer);
+        return ErrorMessageAndCode("PrintInstruction unknown opcode kind\n", 1);
+    }
+    WriteText(Writer, &InstructionKindText[Instruction->Opcode.InstructionKind]);
+    switch(Instruction->Opcode.Kind)
+    {
+    case opcode_kind_SegmentRegister:
+    case opcode_kind_RegisterMemoryToFromRegister:
+    {
+        WriteChar(Writer, ' ');
+        if (Instruction->MOD == 0b11) WriteRegisterOperands(Writer, DestinationText, &RegisterNameText[Instruction->SourceRegister]);
+        else if (Instruction->D)
+        {
+            WriteText(Writer, DestinationText);
+            WriteBytes(Writer, ", ", 2);
+            WriteEffectiveAddress(Writer, Instruction);
+        }
+        else
         {
-            UpdateFlags(DestinationRegisterValue - ValueToWrite);
-        } break;
-        default: break;
+            WriteEffectiveAddress(Writer, Instruction);
+            WriteBytes(Writer, ", ", 2);
+            WriteText(Writer, DestinationText);
         }
     } break;
+    case opcode_kind_ImmediateToRegisterMemory:
+    {
+        char *SizeName = DisplayByteSize(Instruction->W);
+        WriteChar(Writer, ' ');
+        if (!Instruction->IsMove)
+        {
+            WriteBytes(Writer, SizeName, 4);
+            WriteChar(Writer, ' ');
+        }
+        if (Instruction->MOD == 0b11) WriteText(Writer, DestinationText);
+        else WriteEffectiveAddress(Writer, Instruction);
+        WriteBytes(Writer, ", ", 2);
+        if (Instruction->IsMove)
+        {
+            WriteBytes(Writer, SizeName, 4);
+            WriteChar(Writer, ' ');
+        }
+        WriteDecimal(Writer, Immediate);
+    } break;
+    case opcode_kind_ImmediateToRegister:
+    {
+        WriteChar(Writer, ' ');
+        WriteText(Writer, DestinationText);
+        WriteBytes(Writer, ", ", 2);
+        WriteDecimal(Writer, Immediate);
+    } break;
+    case opcode_kind_MemoryAccumulator:
+    {
+        char *AccumulatorRegister = Instruction->IsWideData ? "ax" : "al";
+        s32 IsMemory = Instruction->IsMove;
+        WriteChar(Writer, ' ');
+        if (!Instruction->D)
+        {
+            WriteBytes(Writer, AccumulatorRegister, 2);
+            WriteBytes(Writer, ", ", 2);
+        }
+        if (IsMemory)
+        {
+            WriteChar(Writer, '[');
+            if (Instruction->HasSegmentOverride) WriteText(Writer, &SegmentPrefixText[Instruction->Segment]);
+        }
+        WriteDecimal(Writer, Immediate);
+        if (IsMemory) WriteChar(Writer, ']');
+        if (Instruction->D)
+        {
+            WriteBytes(Writer, ", ", 2);
+            WriteBytes(Writer, AccumulatorRegister, 2);
+        }
+    } break;
+    default:
+        break;
+    }
+    WriteChar(Writer, '\n');
+    return 0;
+}
+
+/*
+  Clock estimates
+  ===============
+  With --clocks the loop core estimates how long every instruction would take on a real 8086, from
+  the timing tables of the 8086 family user's manual: the clocks of the instruction form, plus the
+  effective address calculation when there is a memory operand, plus WORD_TRANSFER_PENALTY clocks for
+  every word the instruction moves over the bus at an odd address. --8088 estimates for the 8-bit bus
+  instead, which splits every word transfer in two whatever its address. Prefetch queue and bus
+  contention effects are not modelled, so these are the manual's numbers rather than a cycle-exact
+  machine.
+*/
+#define WORD_TRANSFER_PENALTY 4
+#define SEGMENT_OVERRIDE_CLOCKS 2
+// NOTE: the longest suffix is " ; Clocks: +N = TOTAL (B + Eea + Pp)" with a 20-digit total
+#define MAX_CLOCK_TEXT 96
+
+// NOTE: the manual's effective address table, one row per eac_* kind
+u8 EffectiveAddressClockTable[eac_Count] = {
+    [eac_SI] = 5, [eac_DI] = 5, [eac_BX] = 5,
+    [eac_DIRECT_ADDRESS] = 6,
+    [eac_SI_D8] = 9, [eac_DI_D8] = 9, [eac_BP_D8] = 9, [eac_BX_D8] = 9,
+    [eac_SI_D16] = 9, [eac_DI_D16] = 9, [eac_BP_D16] = 9, [eac_BX_D16] = 9,
+    [eac_BP_DI] = 7, [eac_BX_SI] = 7,
+    [eac_BP_SI] = 8, [eac_BX_DI] = 8,
+    [eac_BP_DI_D8] = 11, [eac_BX_SI_D8] = 11, [eac_BP_DI_D16] = 11, [eac_BX_SI_D16] = 11,
+    [eac_BP_SI_D8] = 12, [eac_BX_DI_D8] = 12, [eac_BP_SI_D16] = 12, [eac_BX_DI_D16] = 12,
+};
+
+typedef struct
+{
+    u8 Clocks;
+    // NOTE: memory reads plus memory writes, each one pays the word transfer penalty
+    u8 Transfers;
+} form_clocks;
+
+/* Rows are in clock_form order: register-register, register-memory, memory-register,
+   register-immediate, memory-immediate, accumulator-immediate, accumulator-memory, memory-accumulator. */
+#define ARITHMETIC_FORM_CLOCKS {{3, 0}, {9, 1}, {16, 2}, {4, 0}, {17, 2}, {4, 0}}
+form_clocks FormClockTable[instruction_kind_Count][clock_form_Count] = {
+    [instruction_kind_Mov] = {{2, 0}, {8, 1}, {9, 1}, {4, 0}, {10, 1}, {4, 0}, {10, 1}, {10, 1}},
+    [instruction_kind_Add] = ARITHMETIC_FORM_CLOCKS,
+    [instruction_kind_Adc] = ARITHMETIC_FORM_CLOCKS,
+    [instruction_kind_Sub] = ARITHMETIC_FORM_CLOCKS,
+    [instruction_kind_Sbb] = ARITHMETIC_FORM_CLOCKS,
+    // NOTE: cmp never writes its destination back
+    [instruction_kind_Cmp] = {{3, 0}, {9, 1}, {9, 1}, {4, 0}, {10, 1}, {4, 0}},
+};
+
+typedef struct
+{
+    u8 Single;
+    u8 RepeatBase;
+    u8 PerRepetition;
+    // NOTE: transfers through SI and through DI for every element
+    u8 SourceTransfers;
+    u8 DestinationTransfers;
+} string_clocks;
+
+string_clocks StringClockTable[instruction_kind_Count] = {
+    [instruction_kind_Movs] = {18, 9, 17, 1, 1},
+    [instruction_kind_Cmps] = {22, 9, 22, 1, 1},
+    [instruction_kind_Scas] = {15, 9, 15, 0, 1},
+    [instruction_kind_Lods] = {12, 9, 13, 1, 0},
+    [instruction_kind_Stos] = {11, 9, 10, 0, 1},
+};
+
+typedef struct
+{
+    u8 Taken;
+    u8 NotTaken;
+} jump_clocks;
+
+// NOTE: indexed like SimulateLoop, loopnz, loopz, loop and jcxz
+jump_clocks LoopClockTable[4] = {{19, 5}, {18, 6}, {17, 5}, {18, 6}};
+jump_clocks ConditionalJumpClocks = {16, 4};
+
+static jump_clocks GetJumpClocks(decoded_instruction *Instruction)
+{
+    return Instruction->FirstByte >= LOOPNZ ? LoopClockTable[Instruction->FirstByte & 0b11] : ConditionalJumpClocks;
+}
+
+static clock_form GetClockForm(decoded_instruction *Instruction)
+{
+    switch(Instruction->Opcode.Kind)
+    {
+    case opcode_kind_ImmediateToRegisterMemory:
+        return Instruction->MOD == 0b11 ? clock_form_RegisterImmediate : clock_form_MemoryImmediate;
+    case opcode_kind_ImmediateToRegister:
+        return clock_form_RegisterImmediate;
+    case opcode_kind_MemoryAccumulator:
+        if (!Instruction->IsMove) return clock_form_AccumulatorImmediate;
+        return Instruction->D ? clock_form_MemoryAccumulator : clock_form_AccumulatorMemory;
+    case opcode_kind_SegmentRegister:
+    case opcode_kind_RegisterMemoryToFromRegister:
+    default:
+        if (Instruction->MOD == 0b11) return clock_form_RegisterRegister;
+        return Instruction->D ? clock_form_RegisterMemory : clock_form_MemoryRegister;
+    }
+}
+
+// NOTE: the penalty for one transfer; Offset only matters on the 8086, a segment base never changes whether an address is odd
+static u32 GetWordTransferPenalty(clock_model Model, s32 IsWide, u16 Offset)
+{
+    if (!IsWide) return 0;
+    if (Model == clock_model_8088) return WORD_TRANSFER_PENALTY;
+    return (Offset & 1) * WORD_TRANSFER_PENALTY;
+}
+
+// NOTE: everything but jumps and strings; Transfers receives the number of memory transfers for the caller to price
+static instruction_clocks GetFormClocks(decoded_instruction *Instruction, u32 *Transfers)
+{
+    instruction_clocks Clocks = {0};
+    clock_form Form = GetClockForm(Instruction);
+    form_clocks *Timing = &FormClockTable[Instruction->Opcode.InstructionKind][Form];
+    Clocks.Base = Timing->Clocks;
+    *Transfers = Timing->Transfers;
+    // NOTE: mov acc, [addr] has its address in the instruction and no effective address calculation
+    if (Form == clock_form_RegisterMemory || Form == clock_form_MemoryRegister || Form == clock_form_MemoryImmediate)
+    {
+        Clocks.EffectiveAddress = EffectiveAddressClockTable[Instruction->EffectiveAddress];
+        if (Instruction->HasSegmentOverride) Clocks.EffectiveAddress += SEGMENT_OVERRIDE_CLOCKS;
+    }
+    return Clocks;
+}
+
+// NOTE: a move to or from a segment register always moves a word, whatever the W bit says
+static s32 IsWideTransfer(decoded_instruction *Instruction)
+{
+    return Instruction->W || Instruction->Opcode.Kind == opcode_kind_SegmentRegister;
+}
+
+static void SampleClockState(sim_context *Context, decoded_instruction *Instruction, clock_sample *Sample)
+{
+    Sample->Count = ReadRegister(Context, CX);
+    Sample->SourceIndex = ReadRegister(Context, SI);
+    Sample->DestinationIndex = ReadRegister(Context, DI);
+    Sample->Offset = Instruction->Opcode.Kind == opcode_kind_MemoryAccumulator ? (u16)Instruction->Immediate : GetEffectiveAddressOffset(Context, Instruction);
+}
+
+/*
+  Called after the instruction ran, with the state SampleClockState took before it. Jumps read their
+  outcome from LastJumpTaken, and repeated strings count their repetitions from how far CX went down.
+*/
+static instruction_clocks EstimateInstructionClocks(sim_context *Context, decoded_instruction *Instruction, clock_sample *Sample)
+{
+    instruction_clocks Clocks = {0};
+    clock_model Model = Context->ClockModel;
+    switch(Instruction->Opcode.Kind)
+    {
+    case opcode_kind_Jump:
+    {
+        jump_clocks Timing = GetJumpClocks(Instruction);
+        Clocks.Base = Context->LastJumpTaken ? Timing.Taken : Timing.NotTaken;
+    } break;
+    case opcode_kind_String:
+    {
+        string_clocks *Timing = &StringClockTable[Instruction->Opcode.InstructionKind];
+        u32 Repetitions = Instruction->RepeatPrefix ? (u16)(Sample->Count - ReadRegister(Context, CX)) : 1;
+        u32 ElementPenalty = Timing->SourceTransfers * GetWordTransferPenalty(Model, Instruction->W, Sample->SourceIndex) +
+            Timing->DestinationTransfers * GetWordTransferPenalty(Model, Instruction->W, Sample->DestinationIndex);
+        Clocks.Base = Instruction->RepeatPrefix ? Timing->RepeatBase + Timing->PerRepetition * Repetitions : Timing->Single;
+        Clocks.Penalty = ElementPenalty * Repetitions;
+    } break;
+    case opcode_kind_Halt:
+    case opcode_kind_FlagControl:
+        Clocks.Base = 2;
+        break;
     default:
-        return ErrorMessageAndCode("SimulateRegisterToRegister unknown simulation_mode!\n", 1);
+    {
+        u32 Transfers;
+        Clocks = GetFormClocks(Instruction, &Transfers);
+        Clocks.Penalty = Transfers * GetWordTransferPenalty(Model, IsWideTransfer(Instruction), Sample->Offset);
+    } break;
     }
-    return 0;
+    return Clocks;
 }
 
-static s32 SimulateRegisterAndEffectiveAddress(simulation_mode Mode, opcode Opcode, s16 DestinationRegister, effective_address EffectiveAddress, s16 D, s32 IsDirectAddress, s16 Immediate, s16 Offset)
+// NOTE: "8 + 9ea + 4p", leaving out the parts that are zero
+static void WriteClockParts(output_writer *Writer, instruction_clocks Clocks)
 {
-    char DirectAddressDisplay[64];
-    char *EffectiveAddressDisplay = GetEffectiveAddressDisplay(EffectiveAddress);
-    char *InstructionKindString = DisplayInstructionKind(Opcode.InstructionKind);
-    s32 ValueToWrite = 0;
-    s32 MemoryIndex = -1;
-    s32 IsWide = 1; // TODO: IsWide should be determined in some way, using the effective address or passing in a new IsWide argument.
-    if (IsDirectAddress)
+    WriteDecimal(Writer, Clocks.Base);
+    if (Clocks.EffectiveAddress)
     {
-        sprintf(DirectAddressDisplay, "[%d]%c", Immediate, 0);
-        EffectiveAddressDisplay = DirectAddressDisplay;
+        WriteBytes(Writer, " + ", 3);
+        WriteDecimal(Writer, Clocks.EffectiveAddress);
+        WriteBytes(Writer, "ea", 2);
     }
-    switch(Mode)
+    if (Clocks.Penalty)
     {
-    case simulation_mode_Print:
-    {
-        char *DestinationRegisterString = DisplayRegisterName(DestinationRegister);
-        if (D)
-        {
-            printf("%s %s, %s\n", InstructionKindString, DestinationRegisterString, EffectiveAddressDisplay);
-        }
-        else
-        {
-            printf("%s %s, %s\n", InstructionKindString, EffectiveAddressDisplay, DestinationRegisterString);
-        }
-    } break;
-    case simulation_mode_Simulate:
+        WriteBytes(Writer, " + ", 3);
+        WriteDecimal(Writer, Clocks.Penalty);
+        WriteChar(Writer, 'p');
+    }
+}
+
+static void WriteU64Decimal(output_writer *Writer, u64 Value)
+{
+    char Digits[24];
+    s32 Length = snprintf(Digits, sizeof(Digits), "%llu", (unsigned long long)Value);
+    WriteBytes(Writer, Digits, Length);
+}
+
+/*
+  The trace line of one executed instruction: "add ax, [bx + 2] ; Clocks: +19 = 103 (9 + 9ea + 1p)",
+  with the running total after the plus. The parts are only spelled out when there is more than one.
+*/
+static void CountInstructionClocks(sim_context *Context, decoded_instruction *Instruction, clock_sample *Sample, output_writer *Writer)
+{
+    instruction_clocks Clocks = EstimateInstructionClocks(Context, Instruction, Sample);
+    u32 Total = Clocks.Base + Clocks.EffectiveAddress + Clocks.Penalty;
+    Context->ClockCount += Total;
+    Context->ClockPenaltyCount += Clocks.Penalty;
+    if (!Writer) return;
+    Writer->Used = 0;
+    if (PrintInstruction(Writer, Instruction)) return;
+    // NOTE: the clocks go on the instruction's line, in place of its newline
+    Writer->Used -= 1;
+    ReserveOutput(Writer, MAX_CLOCK_TEXT);
+    WriteBytes(Writer, " ; Clocks: +", 12);
+    WriteDecimal(Writer, Total);
+    WriteBytes(Writer, " = ", 3);
+    WriteU64Decimal(Writer, Context->ClockCount);
+    if (Total != Clocks.Base)
     {
-        MemoryIndex = IsDirectAddress ? Immediate : GetMemoryIndexFromEffectiveAddress(EffectiveAddress, Offset);
-        s16 MemoryValue = ReadMemory(MemoryIndex + Offset, IsWide);
-        s16 RegisterValue = ReadRegister(DestinationRegister);
-        switch(Opcode.InstructionKind)
-        {
-        case instruction_kind_Mov:
-            ValueToWrite = D ? MemoryValue : RegisterValue;
-            break;
-        case instruction_kind_Add:
-            ValueToWrite = MemoryValue + RegisterValue;
-            UpdateFlags(ValueToWrite);
-            break;
-        case instruction_kind_Adc:
-            ValueToWrite = MemoryValue + RegisterValue;
-            UpdateFlags(ValueToWrite);
-            break;
-        case instruction_kind_Sub:
-            ValueToWrite = MemoryValue - RegisterValue;
-            UpdateFlags(ValueToWrite);
-            break;
-        case instruction_kind_Sbb:
-            ValueToWrite = MemoryValue - RegisterValue;
-            UpdateFlags(ValueToWrite);
-            break;
-        case instruction_kind_Cmp:
-            ValueToWrite = MemoryValue - RegisterValue;
-            break;
-        default:
-            printf("InstructionKind %s\n", InstructionKindString);
-            return ErrorMessageAndCode("SimulateRegisterAndEffectiveAddress instruction kind not implemented\n", 1);
-        }
-        if (D)
-        {
-            WriteRegister(DestinationRegister, ValueToWrite);
-        }
-        else
-        {
-            WriteMemory(MemoryIndex, ValueToWrite, IsWide);
-        }
-    } break;
-    default:
-        return ErrorMessageAndCode("SimulateRegisterAndEffectiveAddress unknown simulation mode\n", 1);
+        WriteBytes(Writer, " (", 2);
+        WriteClockParts(Writer, Clocks);
+        WriteChar(Writer, ')');
     }
-    return 0;
+    WriteChar(Writer, '\n');
+    fwrite(Writer->Data, 1, Writer->Used, stdout);
 }
 
-static s32 SimulateImmediateToRegisterMemory(simulation_mode Mode, opcode Opcode, s16 DestinationRegister, s32 IsWide, s16 Immediate, s32 IsMove)
+/*
+  The disassembler only sees the instruction bytes, so it appends what is known without running them:
+  both outcomes of a jump, the clocks per repetition of a repeated string, and the odd-address penalty
+  only where the address is in the instruction itself. The 8088 penalty never depends on the address.
+*/
+static void WriteStaticClocks(output_writer *Writer, decoded_instruction *Instruction, clock_model Model)
 {
-    s16 DestinationRegisterValue = ReadRegister(DestinationRegister);
-    char *ImmediateSizeName = DisplayByteSize(IsWide);
-    switch(Mode)
+    instruction_clocks Clocks = {0};
+    Writer->Used -= 1;
+    ReserveOutput(Writer, MAX_CLOCK_TEXT);
+    WriteBytes(Writer, " ; Clocks: ", 11);
+    switch(Instruction->Opcode.Kind)
     {
-    case simulation_mode_Print:
+    case opcode_kind_Jump:
     {
-        char *RegisterName = DisplayRegisterName(DestinationRegister);
-        char *InstructionKindString = DisplayInstructionKind(Opcode.InstructionKind);
-        if (IsMove)
-        {
-            printf("%s %s, %s %d\n", InstructionKindString, RegisterName, ImmediateSizeName, Immediate);
-        }
-        else
-        {
-            printf("%s %s %s, %d\n", InstructionKindString, ImmediateSizeName, RegisterName, Immediate);
-        }
-    } break;
-    case simulation_mode_Simulate:
+        jump_clocks Timing = GetJumpClocks(Instruction);
+        WriteDecimal(Writer, Timing.Taken);
+        WriteBytes(Writer, " taken, ", 8);
+        WriteDecimal(Writer, Timing.NotTaken);
+        WriteBytes(Writer, " not taken\n", 11);
+    } return;
+    case opcode_kind_String:
     {
-        switch(Opcode.InstructionKind)
-        {
-        case instruction_kind_Mov:
-        {
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Add:
-        {
-            Immediate = DestinationRegisterValue + Immediate;
-            UpdateFlags(Immediate);
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Adc:
-        {
-            Immediate = DestinationRegisterValue + Immediate;
-            UpdateFlags(Immediate);
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Sub:
+        string_clocks *Timing = &StringClockTable[Instruction->Opcode.InstructionKind];
+        u32 ElementPenalty = Model == clock_model_8088 ? (Timing->SourceTransfers + Timing->DestinationTransfers) * GetWordTransferPenalty(Model, Instruction->W, 0) : 0;
+        if (Instruction->RepeatPrefix)
         {
-            Immediate = DestinationRegisterValue - Immediate;
-            UpdateFlags(Immediate);
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Sbb:
-        {
-            Immediate = DestinationRegisterValue - Immediate;
-            UpdateFlags(Immediate);
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Cmp:
-        {
-            UpdateFlags(DestinationRegisterValue - Immediate);
-        } break;
-        default:
-            return ErrorMessageAndCode("SimulateImmediateToRegisterMemory unkown instruction kind!\n", 1);
+            WriteDecimal(Writer, Timing->RepeatBase);
+            WriteBytes(Writer, " + ", 3);
+            WriteDecimal(Writer, Timing->PerRepetition + ElementPenalty);
+            WriteBytes(Writer, "/rep\n", 5);
+            return;
         }
+        Clocks.Base = Timing->Single;
+        Clocks.Penalty = ElementPenalty;
     } break;
+    case opcode_kind_Halt:
+    case opcode_kind_FlagControl:
+        Clocks.Base = 2;
+        break;
     default:
-        return ErrorMessageAndCode("SimulateImmediateToRegisterMemory unknown simulation mode\n", 1);
+    {
+        u32 Transfers;
+        s32 IsWide = IsWideTransfer(Instruction);
+        Clocks = GetFormClocks(Instruction, &Transfers);
+        if (Model == clock_model_8088) Clocks.Penalty = Transfers * GetWordTransferPenalty(Model, IsWide, 0);
+        else if (Instruction->Opcode.Kind == opcode_kind_MemoryAccumulator && Instruction->IsMove) Clocks.Penalty = Transfers * GetWordTransferPenalty(Model, IsWide, Instruction->Immediate);
+        else if (Instruction->IsDirectAddress) Clocks.Penalty = Transfers * GetWordTransferPenalty(Model, IsWide, Instruction->Displacement);
+    } break;
     }
-    return 0;
+    WriteClockParts(Writer, Clocks);
+    WriteChar(Writer, '\n');
 }
 
-static s32 SimulateImmediateToEffectiveAddressWithOffset(simulation_mode Mode, opcode Opcode, effective_address EffectiveAddress, s32 IsWideDisplacement, s16 Immediate, s16 Displacement, s32 IsMove, s32 IsWide)
+static void PrintClockSummary(sim_context *Context)
 {
-    char *ImmediateSizeName = DisplayByteSize(IsWide);
-    char *EffectiveAddressDisplay = GetEffectiveAddressDisplay(EffectiveAddress);
-    s32 MemoryIndex = -1;
-    switch(Mode)
-    {
-    case simulation_mode_Print:
+    u64 Count = Context->InstructionCount;
+    printf("\nClocks (%s):\n  total %llu\n  word transfer penalties %llu\n", Context->ClockModel == clock_model_8088 ? "8088" : "8086",
+           (unsigned long long)Context->ClockCount, (unsigned long long)Context->ClockPenaltyCount);
+    if (Count) printf("  average %.2f clocks/instruction\n", (f64)Context->ClockCount / (f64)Count);
+}
+
+static s32 SimulateInstructions(sim_context *Context, s32 ShouldTrace)
+{
+    s32 Result = 0;
+    decoded_instruction *Instruction;
+    clock_sample ClockSample = {0};
+    // NOTE: the trace prints every instruction with its clocks, formatted here before going to stdout
+    output_writer ClockWriter = {0};
+    s32 ShouldTraceClocks = ShouldTrace && Context->ClockModel;
+    if (InitSimulation(Context)) return ErrorMessageAndCode("Error initializing simulation\n", 1);
+    if (ShouldTraceClocks && InitOutputWriter(&ClockWriter, OUTPUT_TO_MEMORY)) return 1;
+    while(Result == 0)
     {
-        if (IsMove)
-        {
-            printf("%s %s %d], %s %d\n", DisplayInstructionKind(Opcode.InstructionKind), EffectiveAddressDisplay, Displacement, ImmediateSizeName, Immediate);
-        }
-        else
+        if (ShouldTrace) DEBUG_PrintRegisters(Context);
+        Instruction = FetchDecodedInstruction(Context, ReadRegister(Context, IP));
+        if (!Instruction)
         {
-            printf("%s %s %s %d], %d\n", DisplayInstructionKind(Opcode.InstructionKind), ImmediateSizeName, EffectiveAddressDisplay, Displacement, Immediate);
+            free(ClockWriter.Data);
+            return ErrorMessageAndCode("SimulateInstructions default error\n", -1);
         }
-    } break;
-    case simulation_mode_Simulate:
+        if (Context->ClockModel) SampleClockState(Context, Instruction, &ClockSample);
+        SetInstructionBufferIndex(Context, ReadRegister(Context, IP) + Instruction->Length);
+        Result = Instruction->Simulate(Context, Instruction);
+        Context->InstructionCount += 1;
+        if (Context->ClockModel && !Result) CountInstructionClocks(Context, Instruction, &ClockSample, ShouldTraceClocks ? &ClockWriter : 0);
+    }
+    free(ClockWriter.Data);
+    if (Result == SIMULATE_HALTED)
     {
-        switch(EffectiveAddress)
-        {
-        case eac_BX_SI_D8: case eac_BX_DI_D8: case eac_BP_SI_D8: case eac_BP_DI_D8:
-        case eac_BX_SI_D16: case eac_BX_DI_D16: case eac_BP_SI_D16: case eac_BP_DI_D16:
-        case eac_SI_D8: case eac_DI_D8: case eac_BP_D8: case eac_BX_D8:
-        case eac_SI_D16: case eac_DI_D16: case eac_BP_D16: case eac_BX_D16:
-        {
-            MemoryIndex = GetMemoryIndexFromEffectiveAddress(EffectiveAddress, Displacement);
-        } break;
-        // TODO: nocommit we shouldn't need to check the NON-offset paths, since that is done in SimulateImmediateToEffectiveAddress
-        case eac_BX_SI: case eac_BX_DI:
-        case eac_BP_SI: case eac_BP_DI:
-        case eac_SI: case eac_DI: case eac_BX:
-        case eac_DIRECT_ADDRESS: case eac_NONE:
-        default:
-            printf("EffectiveAddress %d %s\n", EffectiveAddress, GetEffectiveAddressDisplay(EffectiveAddress));
-            return ErrorMessageAndCode("SimulateImmediateToEffectiveAddressWithOffset effective address not implememented\n", 1);
-        }
-    } break;
-    default:
-        return ErrorMessageAndCode("SimulateImmediateToEffectiveAddressWithOffset unknown simulation mode\n", 1);
+        Context->InstructionCount -= 1;
+        Result = 0;
     }
-    WriteMemory(MemoryIndex, Immediate, IsWide);
-    return 0;
+    if (!Result && ShouldTrace)
+    {
+        DEBUG_PrintRegisters(Context);
+        if (Context->ClockModel) PrintClockSummary(Context);
+        PrintDecodeCacheStats(Context);
+    }
+    return Result;
+}
+
+#if defined(__GNUC__)
+/*
+  Threaded core
+  =============
+  Same results as SimulateInstructions, but every handler ends by fetching the next decoded
+  instruction and jumping straight to its label (GCC computed goto). There is no central loop, no
+  per-instruction trace check, and handlers that cannot fail skip the result check.
+*/
+#define THREADED_DISPATCH_NEXT() \
+    do { \
+        u16 NextInstructionPointer = *InstructionPointer; \
+        if (Context->DecodeCacheIsValid[NextInstructionPointer]) \
+        { \
+            Instruction = &Context->DecodeCache[NextInstructionPointer]; \
+            Context->DecodeCacheStats.Hits += 1; \
+        } \
+        else \
+        { \
+            Instruction = FetchDecodedInstruction(Context, NextInstructionPointer); \
+            if (!Instruction) goto DecodeError; \
+        } \
+        *InstructionPointer = NextInstructionPointer + Instruction->Length; \
+        InstructionCount += 1; \
+        goto *Labels[Instruction->Op]; \
+    } while(0)
+
+#define THREADED_CHECK_RESULT(Expression) \
+    do { \
+        Result = (Expression); \
+        if (Result) goto Done; \
+    } while(0)
+
+static s32 SimulateInstructionsThreaded(sim_context *Context)
+{
+    static void *Labels[simulate_op_Count] = {
+        [simulate_op_None] = &&UnknownOp,
+        [simulate_op_RegisterToRegister] = &&RegisterToRegister,
+        [simulate_op_MoveToSegmentRegister] = &&MoveToSegmentRegister,
+        [simulate_op_RegisterAndEffectiveAddress] = &&RegisterAndEffectiveAddress,
+        [simulate_op_ImmediateToRegisterMemory] = &&ImmediateToRegisterMemory,
+        [simulate_op_ImmediateToEffectiveAddress] = &&ImmediateToEffectiveAddress,
+        [simulate_op_ImmediateToRegister] = &&ImmediateToRegister,
+        [simulate_op_MemoryAccumulator] = &&MemoryAccumulator,
+        [simulate_op_Jump] = &&Jump,
+        [simulate_op_Loop] = &&Loop,
+        [simulate_op_Halt] = &&Halt,
+        [simulate_op_String] = &&String,
+        [simulate_op_FlagControl] = &&FlagControl,
+    };
+    decoded_instruction *Instruction;
+    // NOTE: IP is read and written in place so that handlers (jumps) see the same register
+    u16 *InstructionPointer = &Context->Registers[RegisterIndexTable[IP]];
+    u64 InstructionCount = 0;
+    s32 Result = 0;
+    if (InitSimulation(Context)) return ErrorMessageAndCode("Error initializing simulation\n", 1);
+    THREADED_DISPATCH_NEXT();
+
+RegisterToRegister:
+    SimulateRegisterToRegister(Context, Instruction);
+    THREADED_DISPATCH_NEXT();
+MoveToSegmentRegister:
+    SimulateMoveToSegmentRegister(Context, Instruction);
+    THREADED_DISPATCH_NEXT();
+RegisterAndEffectiveAddress:
+    THREADED_CHECK_RESULT(SimulateRegisterAndEffectiveAddress(Context, Instruction));
+    THREADED_DISPATCH_NEXT();
+ImmediateToRegisterMemory:
+    THREADED_CHECK_RESULT(SimulateImmediateToRegisterMemory(Context, Instruction));
+    THREADED_DISPATCH_NEXT();
+ImmediateToEffectiveAddress:
+    THREADED_CHECK_RESULT(SimulateImmediateToEffectiveAddress(Context, Instruction));
+    THREADED_DISPATCH_NEXT();
+ImmediateToRegister:
+    SimulateImmediateToRegister(Context, Instruction);
+    THREADED_DISPATCH_NEXT();
+MemoryAccumulator:
+    THREADED_CHECK_RESULT(SimulateMemoryAccumulator(Context, Instruction));
+    THREADED_DISPATCH_NEXT();
+Jump:
+    SimulateJump(Context, Instruction);
+    THREADED_DISPATCH_NEXT();
+Loop:
+    SimulateLoop(Context, Instruction);
+    THREADED_DISPATCH_NEXT();
+String:
+    SimulateString(Context, Instruction);
+    THREADED_DISPATCH_NEXT();
+FlagControl:
+    SimulateFlagControl(Context, Instruction);
+    THREADED_DISPATCH_NEXT();
+Halt:
+    SimulateHalt(Context, Instruction);
+    InstructionCount -= 1;
+    goto Done;
+UnknownOp:
+    Result = ErrorMessageAndCode("SimulateInstructionsThreaded unknown op\n", -1);
+    goto Done;
+DecodeError:
+    Result = ErrorMessageAndCode("SimulateInstructionsThreaded default error\n", -1);
+Done:
+    Context->InstructionCount = InstructionCount;
+    return Result;
+}
+#else
+static s32 SimulateInstructionsThreaded(sim_context *Context)
+{
+    // NOTE: computed goto is a GCC/Clang extension, other compilers get the loop core
+    return SimulateInstructions(Context, 0);
 }
+#endif
 
-static s32 SimulateImmediateToEffectiveAddress(simulation_mode Mode, opcode Opcode, effective_address EffectiveAddress, s32 IsWide, s16 Immediate, s32 IsMove, s32 IsDirectAddress, s16 DirectAddress)
+static s32 SimulateBlockInterpreted(sim_context *Context, translated_block *Block, u64 *InstructionCount)
 {
-    char *ImmediateSizeName = DisplayByteSize(IsWide);
-    char *EffectiveAddressDisplay = GetEffectiveAddressDisplay(EffectiveAddress);
-    char DirectAddressDisplay[64];
-    if (!IsWide) return ErrorMessageAndCode("SimulateImmediateToEffectiveAddress byte sized instructions not implemented!\n", 1);
-    if (IsDirectAddress)
+    s32 I, Step, Result = 0;
+    for (I = 0; I < Block->InstructionCount && Result == 0; I += Step)
     {
-        sprintf(DirectAddressDisplay, "[%d]%c", DirectAddress, 0);
-        EffectiveAddressDisplay = DirectAddressDisplay;
+        decoded_instruction *Instruction = Block->Instructions + I;
+        // NOTE: a superinstruction runs FusedCount instructions and counts as all of them
+        Step = Instruction->FusedCount ? Instruction->FusedCount : 1;
+        SetInstructionBufferIndex(Context, ReadRegister(Context, IP) + Instruction->Length);
+        Result = Instruction->Simulate(Context, Instruction);
+        *InstructionCount += Step;
+        // NOTE: the block wrote over its own code, so the rest of it has to be translated again from IP
+        if (!Block->IsValid) break;
     }
-    switch(Mode)
+    return Result;
+}
+
+static s32 SimulateBlockVerified(sim_context *Context, translated_block *Block, u64 *InstructionCount)
+{
+    // NOTE: compiled blocks never touch memory, so registers and flags are the whole state to compare
+    u16 StartRegisters[REGISTER_COUNT], InterpretedRegisters[REGISTER_COUNT];
+    u16 StartFlags = Context->Flags, InterpretedFlags;
+    s32 Result;
+    memcpy(StartRegisters, Context->Registers, sizeof(Context->Registers));
+    Result = SimulateBlockInterpreted(Context, Block, InstructionCount);
+    if (Result) return Result;
+    MaterializeFlags(Context);
+    memcpy(InterpretedRegisters, Context->Registers, sizeof(Context->Registers));
+    InterpretedFlags = Context->Flags;
+    memcpy(Context->Registers, StartRegisters, sizeof(Context->Registers));
+    Context->Flags = StartFlags;
+    Block->JitFunction(Context->Registers, &Context->Flags, GlobalJitFlagsFromHostFlags);
+    Context->JitStats.BlocksVerified += 1;
+    if (memcmp(InterpretedRegisters, Context->Registers, sizeof(Context->Registers)) || InterpretedFlags != Context->Flags)
     {
-    case simulation_mode_Print:
+        printf("JIT block at %04x disagrees with the interpreter\n  interpreted flags %04x, compiled flags %04x\n", Block->StartIP, InterpretedFlags, Context->Flags);
+        DEBUG_PrintRegisters(Context);
+        return ErrorMessageAndCode("SimulateBlockVerified JIT mismatch\n", 1);
+    }
+    return 0;
+}
+
+static s32 SimulateInstructionsBlocks(sim_context *Context, s32 UseJit, s32 VerifyJit, s32 UseFusion)
+{
+    s32 Result = 0;
+    u64 InstructionCount = 0;
+    if (InitSimulation(Context)) return ErrorMessageAndCode("Error initializing simulation\n", 1);
+    Context->UseFusion = UseFusion;
+    if (UseJit && InitJit(Context)) UseJit = 0;
+    while (Result == 0)
     {
-        if (IsMove)
+        translated_block *Block = FetchTranslatedBlock(Context, ReadRegister(Context, IP));
+        if (!Block) return ErrorMessageAndCode("SimulateInstructionsBlocks default error\n", -1);
+        Context->BlockCacheStats.BlocksExecuted += 1;
+        Block->ExecutionCount += 1;
+        if (UseJit && Block->JitState == jit_state_Cold && Block->ExecutionCount >= JIT_THRESHOLD)
         {
-            printf("%s %s, %s %d\n", DisplayInstructionKind(Opcode.InstructionKind), EffectiveAddressDisplay, ImmediateSizeName, Immediate);
+            Block->JitFunction = JitCompileBlock(&Context->JitCode, Block);
+            Block->JitState = Block->JitFunction ? jit_state_Compiled : jit_state_Unsupported;
+            if (Block->JitFunction) Context->JitStats.BlocksCompiled += 1;
+            else Context->JitStats.BlocksUnsupported += 1;
         }
-        else
+        if (Block->JitState == jit_state_Compiled && Context->JitCode.IsExecutable)
         {
-            printf("%s %s %s, %d\n", DisplayInstructionKind(Opcode.InstructionKind), ImmediateSizeName, EffectiveAddressDisplay, Immediate);
+            // NOTE: compiled code reads and writes Context->Flags directly
+            MaterializeFlags(Context);
+            Context->JitStats.CompiledBlocksExecuted += 1;
+            if (VerifyJit)
+            {
+                Result = SimulateBlockVerified(Context, Block, &InstructionCount);
+            }
+            else
+            {
+                Block->JitFunction(Context->Registers, &Context->Flags, GlobalJitFlagsFromHostFlags);
+                InstructionCount += Block->InstructionCount;
+                Context->JumpCount += Block->Instructions[Block->InstructionCount - 1].Op == simulate_op_Jump;
+            }
         }
-    } break;
-    case simulation_mode_Simulate:
-    {
-        switch(EffectiveAddress)
+        else
         {
-        case eac_DIRECT_ADDRESS:
-            if (!IsDirectAddress) return ErrorMessageAndCode("SimulateImmediateToEffectiveAddress reached eac_DIRECT_ADDRESS but IsDirectAddress is false!\n", 1);
-            return WriteMemory(DirectAddress, Immediate, IsWide);
-        case eac_BX_SI: case eac_BX_DI: case eac_BP_SI: case eac_BP_DI:
-        case eac_SI: case eac_DI: case eac_BX:
-        // TODO: nocommit we shouldn't need to check the offset paths, since that is done in SimulateImmediateToEffectiveAddressWithOffset
-        case eac_BX_SI_D8: case eac_BX_DI_D8: case eac_BP_SI_D8: case eac_BP_DI_D8:
-        case eac_SI_D8: case eac_DI_D8: case eac_BP_D8: case eac_BX_D8:
-        case eac_BX_SI_D16: case eac_BX_DI_D16: case eac_BP_SI_D16: case eac_BP_DI_D16:
-        case eac_SI_D16: case eac_DI_D16: case eac_BP_D16: case eac_BX_D16:
-        case eac_NONE:
-        default:
-            printf("EffectiveAddress %d %s\n", EffectiveAddress, GetEffectiveAddressDisplay(EffectiveAddress));
-            return ErrorMessageAndCode("SimulateImmediateToEffectiveAddress effective address not implememented\n", 1);
+            Result = SimulateBlockInterpreted(Context, Block, &InstructionCount);
         }
-    } break;
-    default:
-        return ErrorMessageAndCode("SimulateImmediateToEffectiveAddress not implemented!\n", 1);
     }
-    return 0;
+    if (Result == SIMULATE_HALTED)
+    {
+        InstructionCount -= 1;
+        Result = 0;
+    }
+    Context->InstructionCount = InstructionCount;
+    return Result;
 }
 
-static s32 SimulateImmediateToRegister(simulation_mode Mode, opcode Opcode, s16 DestinationRegister, s16 Immediate)
+static void PrintJitStats(sim_context *Context)
 {
-    s32 DestinationRegisterIndex = RegisterIndexTable[DestinationRegister];
-    s16 DestinationRegisterValue = GlobalRegisters[DestinationRegisterIndex];
-    switch(Mode)
-    {
-    case simulation_mode_Print:
+    jit_stats Stats = Context->JitStats;
+    printf("\nJIT:\n  blocks compiled %llu\n  blocks left to the interpreter %llu\n  compiled block executions %llu\n  verified block executions %llu\n",
+           (unsigned long long)Stats.BlocksCompiled, (unsigned long long)Stats.BlocksUnsupported,
+           (unsigned long long)Stats.CompiledBlocksExecuted, (unsigned long long)Stats.BlocksVerified);
+}
+
+static s32 SimulateProgram(sim_context *Context, simulation_command_line_args *CommandLineArgs, s32 ShouldTrace)
+{
+    s32 Result;
+    Context->UseBulkStrings = !CommandLineArgs->DisableBulkStrings;
+    // NOTE: only the loop core estimates clocks, ParseArgs turns down --clocks with any other core
+    Context->ClockModel = CommandLineArgs->ClockModel;
+    switch(CommandLineArgs->Core)
     {
-        printf("%s %s, %d\n", DisplayInstructionKind(Opcode.InstructionKind), DisplayRegisterName(DestinationRegister), Immediate);
-    } break;
-    case simulation_mode_Simulate:
+    case simulation_core_Loop: return SimulateInstructions(Context, ShouldTrace);
+    case simulation_core_Threaded: Result = SimulateInstructionsThreaded(Context); break;
+    case simulation_core_Block: Result = SimulateInstructionsBlocks(Context, CommandLineArgs->UseJit, CommandLineArgs->VerifyJit, !CommandLineArgs->DisableFusion); break;
+    default: return ErrorMessageAndCode("SimulateProgram unknown simulation core\n", 1);
+    }
+    if (!Result && ShouldTrace)
     {
-        switch(Opcode.InstructionKind)
-        {
-        case instruction_kind_Mov:
-        {
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Add:
-        {
-            Immediate = DestinationRegisterValue + Immediate;
-            UpdateFlags(Immediate);
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Adc:
-        {
-            Immediate = DestinationRegisterValue + Immediate;
-            UpdateFlags(Immediate);
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Sub:
-        {
-            Immediate = DestinationRegisterValue - Immediate;
-            UpdateFlags(Immediate);
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Sbb:
+        DEBUG_PrintRegisters(Context);
+        if (CommandLineArgs->Core == simulation_core_Block)
         {
-            Immediate = DestinationRegisterValue - Immediate;
-            UpdateFlags(Immediate);
-            WriteRegister(DestinationRegister, Immediate);
-        } break;
-        case instruction_kind_Cmp:
-        {
-            UpdateFlags(DestinationRegisterValue - Immediate);
-        } break;
-        default: break;
+            PrintBlockCacheStats(Context);
+            if (!CommandLineArgs->DisableFusion) PrintFusionStats(Context);
         }
-    } break;
-    default:
-        return ErrorMessageAndCode("SimulateImmediateToRegister unknown simulation mode\n", 1);
+        else PrintDecodeCacheStats(Context);
+        if (CommandLineArgs->UseJit) PrintJitStats(Context);
     }
+    return Result;
+}
+
+/*
+  Delta memory dumps
+  ==================
+  A dump holds only the dirty pages of guest memory, merged into ranges; every byte outside the
+  ranges is zero. All integers are little-endian u32:
+
+      "8086DLTA"  MemorySize  RangeCount  { Start  ByteCount  <ByteCount bytes> } * RangeCount
+
+  `--expand-dump DELTA OUTPUT` turns a dump back into a flat MemorySize image.
+*/
+#define MEMORY_DUMP_MAGIC "8086DLTA"
+
+static void WriteU32(FILE *File, u32 Value)
+{
+    u8 Bytes[4];
+    Bytes[0] = Value & 0xff;
+    Bytes[1] = (Value >> 8) & 0xff;
+    Bytes[2] = (Value >> 16) & 0xff;
+    Bytes[3] = (Value >> 24) & 0xff;
+    fwrite(Bytes, 1, 4, File);
+}
+
+static s32 ReadU32(FILE *File, u32 *Value)
+{
+    u8 Bytes[4];
+    if (fread(Bytes, 1, 4, File) != 4) return 1;
+    *Value = Bytes[0] | (Bytes[1] << 8) | (Bytes[2] << 16) | ((u32)Bytes[3] << 24);
     return 0;
 }
 
-static s32 SimulateMemoryAccumulator(simulation_mode Mode, opcode Opcode, s16 Immediate, s16 D, s32 IsMove, s32 IsWideData)
+static s32 WriteMemoryDump(sim_context *Context, char *FilePath)
+{
+    s32 Page = 0, RangeCount = 0, Result = 0;
+    u32 Start, ByteCount;
+    FILE *File = fopen(FilePath, "wb");
+    if (!File) return ErrorMessageAndCode("Could not write memory dump\n", 1);
+    while (NextDirtyRange(Context->DirtyPages, &Page, &Start, &ByteCount)) RangeCount += 1;
+    fwrite(MEMORY_DUMP_MAGIC, 1, 8, File);
+    WriteU32(File, MEMORY_SIZE);
+    WriteU32(File, RangeCount);
+    for (Page = 0; NextDirtyRange(Context->DirtyPages, &Page, &Start, &ByteCount);)
+    {
+        WriteU32(File, Start);
+        WriteU32(File, ByteCount);
+        fwrite(Context->Memory + Start, 1, ByteCount, File);
+    }
+    if (ferror(File)) Result = ErrorMessageAndCode("Could not write memory dump\n", 1);
+    fclose(File);
+    return Result;
+}
+
+static s32 ExpandMemoryDump(char *DeltaPath, char *OutputPath)
 {
-    switch(Mode)
+    char Magic[8];
+    u32 MemorySize, RangeCount, I;
+    u8 *Image = 0;
+    s32 Result = 0;
+    FILE *OutputFile;
+    FILE *File = fopen(DeltaPath, "rb");
+    if (!File) return ErrorMessageAndCode("Could not open memory dump\n", 1);
+    if (fread(Magic, 1, 8, File) != 8 || memcmp(Magic, MEMORY_DUMP_MAGIC, 8) ||
+        ReadU32(File, &MemorySize) || ReadU32(File, &RangeCount) || MemorySize > MEMORY_SIZE)
+    {
+        fclose(File);
+        return ErrorMessageAndCode("Not a delta memory dump\n", 1);
+    }
+    Image = calloc(MemorySize ? MemorySize : 1, 1);
+    if (!Image)
     {
-    case simulation_mode_Print:
+        fclose(File);
+        return ErrorMessageAndCode("Could not allocate the expanded memory image\n", 1);
+    }
+    for (I = 0; I < RangeCount && !Result; ++I)
     {
-        char *AccumulatorRegister = IsWideData ? "ax" : "al";
-        if (D)
+        u32 Start, ByteCount;
+        if (ReadU32(File, &Start) || ReadU32(File, &ByteCount) ||
+            Start > MemorySize || ByteCount > MemorySize - Start ||
+            fread(Image + Start, 1, ByteCount, File) != ByteCount)
         {
-            char *Format = IsMove ? "%s [%d], %s\n" : "%s %d, %s\n";
-            printf(Format, DisplayInstructionKind(Opcode.InstructionKind), Immediate, AccumulatorRegister);
+            Result = ErrorMessageAndCode("Memory dump range is truncated or out-of-bounds\n", 1);
         }
+    }
+    fclose(File);
+    if (!Result)
+    {
+        OutputFile = fopen(OutputPath, "wb");
+        if (!OutputFile) Result = ErrorMessageAndCode("Could not write the expanded memory image\n", 1);
         else
         {
-            char *Format = IsMove ? "%s %s, [%d]\n" : "%s %s, %d\n";
-            printf(Format, DisplayInstructionKind(Opcode.InstructionKind), AccumulatorRegister, Immediate);
+            if (fwrite(Image, 1, MemorySize, OutputFile) != MemorySize) Result = ErrorMessageAndCode("Could not write the expanded memory image\n", 1);
+            fclose(OutputFile);
         }
-    } break;
-    default:
-        return ErrorMessageAndCode("SimulateMemoryAccumulator not implemented!\n", 1);
     }
-    return 0;
+    free(Image);
+    return Result;
 }
 
-static s32 SimulateJump(simulation_mode Mode, s8 InstructionOffset)
+/*
+  Runs the loaded program ForkCount times, each time from a copy-on-write restore of the same snapshot.
+  Variants differ only in their input: each one starts with AX holding its variant index.
+*/
+static s32 RunSnapshotVariants(sim_context *Context, simulation_command_line_args *CommandLineArgs)
 {
-    s16 InstructionPointer = ReadRegister(IP);
-    s16 InstructionValue = ReadMemory(InstructionPointer, 1);
-    char *JumpInstructionName = JumpInstructionNameTable[InstructionValue];
-    s32 JumpIndex = InstructionPointer + InstructionOffset;
-    switch(Mode)
+    s32 I, Result = 0;
+    u64 InstructionCount = 0;
+    f64 StartSeconds, ElapsedSeconds;
+    sim_context *Child;
+    sim_snapshot *Snapshot = TakeSnapshot(Context);
+    if (!Snapshot) return ErrorMessageAndCode("Could not take a snapshot\n", 1);
+    Child = ForkSnapshot(Snapshot);
+    if (!Child)
     {
-    case simulation_mode_Print:
-    {
-        printf("%s $+2+%d\n", JumpInstructionName, InstructionOffset);
-    } break;
-    case simulation_mode_Simulate:
+        FreeSnapshot(Snapshot);
+        return ErrorMessageAndCode("Could not fork a snapshot\n", 1);
+    }
+    StartSeconds = GetWallClockSeconds();
+    for (I = 0; I < CommandLineArgs->ForkCount && !Result; ++I)
     {
-        switch(InstructionValue)
-        {
-        case JE:
-        {
-            if (GET_FLAG(GlobalFlags, flag_Zero)) SetInstructionBufferIndex(JumpIndex);
-        } break;
-        case JNE:
-        {
-            if (!GET_FLAG(GlobalFlags, flag_Zero)) SetInstructionBufferIndex(JumpIndex);
-        } break;
-        case JL: case JNL:
-        case JLE: case JNLE:
-        case JB: case JNB:
-        case JBE: case JNBE:
-        case JP: case JNP:
-        case JO: case JNO:
-        case JS: case JNS:
-        case LOOP:
-        case LOOPZ:
-        case LOOPNZ:
-        case JCXZ:
-        default:
-            printf("Jump Instruction %s\n", JumpInstructionName);
-            return ErrorMessageAndCode("SimulateJump instruction not implemented\n", 1);
-        }
-    } break;
-    default:
-        return ErrorMessageAndCode("SimulateJump unknown simulation mode\n", 1);
+        Result = RestoreSnapshot(Child, Snapshot);
+        if (Result) break;
+        WriteRegister(Child, AX, (s16)I);
+        Result = SimulateProgram(Child, CommandLineArgs, 0);
+        InstructionCount += Child->InstructionCount;
     }
-    return 0;
+    ElapsedSeconds = GetWallClockSeconds() - StartSeconds;
+    if (!Result) DEBUG_PrintRegisters(Child);
+    printf("Fork: %d variants, %llu instructions, %.3f seconds, %.1f variants/second\n",
+           I, (unsigned long long)InstructionCount, ElapsedSeconds,
+           ElapsedSeconds > 0 ? (f64)I / ElapsedSeconds : 0.0);
+    FreeSimContext(Child);
+    FreeSnapshot(Snapshot);
+    return Result;
 }
 
-static void DEBUG_PrintGlobalRegisters()
+#include "batch.c"
+
+static s32 DisassembleInstructions(u8 *Memory, s32 Size, clock_model ClockModel)
 {
-    char *NameMap[] = {"AX", "BX", "CX", "DX", "SP", "BP", "SI", "DI", "CS", "DS", "SS", "ES", "IP"};
-    s32 I;
-    printf("----------------------\nRegisters:\n");
-    for (I = 0; I < REGISTER_COUNT; ++I)
+    s32 Result = 0, InstructionPointer = 0;
+    output_writer Writer;
+    if (InitOutputWriter(&Writer, STDOUT_FILENO)) return 1;
+    WriteBytes(&Writer, "bits 16\n", 8);
+    while(Result == 0 && InstructionPointer < Size)
     {
-        if (GlobalRegisters[I]) printf("  %s %0004x \n", NameMap[I], GlobalRegisters[I]);
+        decoded_instruction Instruction;
+        Result = DecodeInstruction(Memory, 0, InstructionPointer, &Instruction);
+        if (Result) break;
+        if (Instruction.Opcode.Kind == opcode_kind_Halt) break;
+        Result = PrintInstruction(&Writer, &Instruction);
+        if (!Result && ClockModel) WriteStaticClocks(&Writer, &Instruction, ClockModel);
+        InstructionPointer += Instruction.Length;
     }
-    printf("\nFlags:           DIOSZAPC\n      ");
-    DEBUG_PrintByteInBinary(0xff & (GlobalFlags >> 8));
-    DEBUG_PrintByteInBinary(0xff & GlobalFlags);
-    printf("\n");
+    // NOTE: a decode error was printed before the lines still in the buffer, but a buffered stdout holds it until after them
+    if (FreeOutputWriter(&Writer) && !Result) Result = 1;
+    return Result;
 }
 
-static s32 SimulateInstructions(simulation_mode Mode)
+#include "scan.c"
+#include "stream.c"
+
+static s32 BenchmarkInstructions(sim_context *Context, u8 *Program, s32 ProgramSize, s32 RepeatCount, simulation_command_line_args *CommandLineArgs)
 {
-    s32 Result = 0, Running = 1;
-    if (InitSimulation(Mode)) return ErrorMessageAndCode("Error initializing simulation\n", 1);
-    while(Running && Result == 0)
+    s32 I, Result = 0;
+    u64 InstructionCount = 0, JumpCount = 0;
+    f64 ElapsedSeconds = 0, StartSeconds;
+    for (I = 0; I < RepeatCount && Result == 0; ++I)
     {
-        if (1 && Mode != simulation_mode_Print) DEBUG_PrintGlobalRegisters();
-        u8 FirstByte = ReadMemory(ReadRegister(IP), 1);
-        u8 OpcodeValue = GET_OPCODE(FirstByte);
-        opcode Opcode = OpcodeTable[OpcodeValue];
-        opcode_kind FullByteOpcodeKind = FullByteOpcodeTable[FirstByte];
-        if (FullByteOpcodeKind)
-        {
-            // NOTE: hack because the simulator started off only parsing 6-bit opcodes.....
-            Opcode = (opcode){FullByteOpcodeKind,0};
-        }
-        s16 D = GET_D(FirstByte);
-        s16 W = GET_W(FirstByte);
-        s32 InstructionLength = 2; /* we just guess that InstructionLength is 2 and update it in places where it is not */
-        switch(Opcode.Kind)
-        {
-        case opcode_kind_SegmentRegister:
-        case opcode_kind_RegisterMemoryToFromRegister:
-        {
-            s32 IsSegment = Opcode.Kind == opcode_kind_SegmentRegister;
-            u8 SecondByte = ReadMemory(ReadRegister(IP) + 1, 1);
-            s16 MOD = GET_MOD(SecondByte);
-            s16 REG = GET_REG(SecondByte);
-            s16 RM = GET_RM(SecondByte);
-            if(MOD == 0b11)
-            {
-                s16 RegIndex = IsSegment ? SegmentRegisterTable[(REG & 0b11)] : RegTable[REG][W];
-                s32 RmIsWide = IsSegment || W;
-                s16 RmIndex = RegTable[RM][RmIsWide];
-                s16 DestinationRegister = D ? RegIndex : RmIndex;
-                s16 SourceRegister      = D ? RmIndex  : RegIndex;
-                Result = SimulateRegisterToRegister(Mode, Opcode, DestinationRegister, SourceRegister);
-            }
-            else
-            {
-                s16 DestinationRegister = GetRegisterIndex(REG, W, IsSegment);
-                effective_address EffectiveAddress = EffectiveAddressCalculationTable[MOD][RM];
-                if (MOD == 0b01 || MOD == 0b10)
-                {
-                    InstructionLength = MOD == 0b10 ? 4 : 3;
-                    s16 Immediate = GetImmediate(2, MOD == 0b10);
-                    Result = SimulateRegisterAndEffectiveAddress(Mode, Opcode, DestinationRegister, EffectiveAddress, D, 0, 0, Immediate);
-                }
-                else
-                {
-                    // NOTE: MOD == 0b00
-                    s32 IsDirectAddress = EffectiveAddress == eac_DIRECT_ADDRESS;
-                    s16 Immediate = 0;
-                    if (IsDirectAddress)
-                    {
-                        Immediate = GetImmediate(2, 1);
-                        InstructionLength = 4;
-                    }
-                    Result = SimulateRegisterAndEffectiveAddress(Mode, Opcode, DestinationRegister, EffectiveAddress, D, IsDirectAddress, Immediate, 0);
-                }
-            }
-        } break;
-        case opcode_kind_ImmediateToRegisterMemory:
-        {
-            u8 SecondByte = ReadMemory(ReadRegister(IP) + 1, 1);
-            s32 IsMove = OpcodeValue == MOV_IMMEDIATE_TO_REGISTER_MEMORY;
-            s32 IsMoveAndWideData = IsMove && W;
-            s32 IsWideData = IsMoveAndWideData || (!IsMove && !D && W);
-            s16 MOD = GET_MOD(SecondByte);
-            s16 REG = GET_REG(SecondByte);
-            s16 RM = GET_RM(SecondByte);
-            if (OpcodeValue == 0b100000)
-            {
-                Opcode.InstructionKind = GetInstructionKindForArithmeticImmediateFromRegisterMemory(REG);
-            }
-            if(MOD == 0b11)
-            {
-                InstructionLength = IsWideData ? 4 : 3;
-                s16 Immediate = GetImmediate(2, IsWideData);
-                s16 DestinationRegister = RegTable[RM][W];
-                Result = SimulateImmediateToRegisterMemory(Mode, Opcode, DestinationRegister, W, Immediate, IsMove);
-            }
-            else
-            {
-                effective_address EffectiveAddress = EffectiveAddressCalculationTable[MOD][RM];
-                if (MOD == 0b01 || MOD == 0b10)
-                {
-                    s16 IsWideDisplacement = MOD == 0b10;
-                    if (MOD == 0b01)
-                    {
-                        InstructionLength = IsWideData ? 5 : 4;
-                    }
-                    else
-                    {
-                        InstructionLength = IsWideData ? 6 : 5;
-                    }
-                    s16 Displacement = GetImmediate(2, IsWideDisplacement);
-                    s16 ImmediateOffset = MOD == 0b10 ? 4 : 3;
-                    s16 Immediate = GetImmediate(ImmediateOffset, IsWideData);
-                    printf("Immediate %d       Displacement %d\n", Immediate, Displacement);
-                    Result = SimulateImmediateToEffectiveAddressWithOffset(Mode, Opcode, EffectiveAddress, IsWideDisplacement, Immediate, Displacement, IsMove, W);
-                }
-                else
-                {
-                    // MOD == 0b00
-                    // TODO: add in check for direct address
-                    s16 Immediate = GetImmediate(2, IsWideData);
-                    s16 DirectAddress = 0;
-                    s32 IsDirectAddress = EffectiveAddress == eac_DIRECT_ADDRESS;
-                    InstructionLength = IsWideData ? 4 : 3;
-                    if (IsDirectAddress)
-                    {
-                        DirectAddress = GetImmediate(2, 1);
-                        Immediate = GetImmediate(4, IsWideData);
-                        InstructionLength = IsWideData ? 6 : 5;
-                    }
-                    Result = SimulateImmediateToEffectiveAddress(Mode, Opcode, EffectiveAddress, W, Immediate, IsMove, IsDirectAddress, DirectAddress);
-                }
-            }
-        } break;
-        case opcode_kind_ImmediateToRegister:
-        {
-            s16 REG = GET_IMMEDIATE_TO_REGISTER_REG(FirstByte);
-            s16 W = GET_IMMEDIATE_TO_REGISTER_W((s32)FirstByte);
-            s16 DestinationRegister = RegTable[REG][W];
-            s16 Immediate = GetImmediate(1, W);
-            InstructionLength = W ? 3 : 2;
-            Result = SimulateImmediateToRegister(Mode, Opcode, DestinationRegister, Immediate);
-        } break;
-        case opcode_kind_MemoryAccumulator:
-        {
-            s32 IsMove = OpcodeValue == MOV_ACCUMULATOR_TO_FROM_MEMORY;
-            s32 IsWideData = IsMove || W;
-            InstructionLength = IsWideData ? 3 : 2;
-            s16 Immediate = GetImmediate(1, IsWideData);
-            Result = SimulateMemoryAccumulator(Mode, Opcode, Immediate, D, IsMove, IsWideData);
-        } break;
-        case opcode_kind_RegisterToRegisterMemory:
-            return ErrorMessageAndCode("opcode_kind_RegisterToRegisterMemory not implemented\n", -1);
-        case opcode_kind_Jump:
-        {
-            s8 InstructionOffset = GetImmediate(1, 0);
-            InstructionLength = 2;
-            Result = SimulateJump(Mode, InstructionOffset);
-        } break;
-        case opcode_kind_Halt:
-            // NOTE: set InstructionLength just to make it easier to check with the reference simulator
-            InstructionLength = 0;
-            Running = 0;
-            break;
-        default:
-            printf("FirstByte"); DEBUG_PrintByteInBinary(FirstByte); printf("\n");
-            return ErrorMessageAndCode("SimulateInstructions default error\n", -1);
-        }
-        SetInstructionBufferIndex(ReadRegister(IP) + InstructionLength);
+        // NOTE: each run starts from a fresh machine with the original program bytes, so self-modifying programs repeat the same work
+        memset(Context->Registers, 0, sizeof(Context->Registers));
+        Context->Flags = 0;
+        Result = LoadProgram(Context, Program, ProgramSize, CommandLineArgs->LoadSegment, CommandLineArgs->LoadOffset);
+        if (Result) break;
+        StartSeconds = GetWallClockSeconds();
+        Result = SimulateProgram(Context, CommandLineArgs, 0);
+        ElapsedSeconds += GetWallClockSeconds() - StartSeconds;
+        InstructionCount += Context->InstructionCount;
+        JumpCount += Context->JumpCount;
     }
-    if (!Result && Mode != simulation_mode_Print) DEBUG_PrintGlobalRegisters();
+    printf("Benchmark: %d runs, %llu instructions, %.3f seconds, %.2f million instructions/second\n",
+           I, (unsigned long long)InstructionCount, ElapsedSeconds,
+           ElapsedSeconds > 0 ? (f64)InstructionCount / ElapsedSeconds / 1000000.0 : 0.0);
+    printf("Benchmark: %llu jumps, %.2f million jumps/second\n", (unsigned long long)JumpCount,
+           ElapsedSeconds > 0 ? (f64)JumpCount / ElapsedSeconds / 1000000.0 : 0.0);
     return Result;
 }
 
 static s32 TestSim(simulation_command_line_args CommandLineArgs)
 {
     s32 I, SimResult = 0;
-    simulation_mode Mode = simulation_mode_Simulate;
-    char *FilePaths[] = {
+    sim_context *Context;
+    char *DefaultFilePaths[] = {
         /* "../assets/listing_0039_more_movs", */
         /* "../assets/listing_0040_challenge_movs", */
         /* "../assets/listing_0041_add_sub_cmp_jnz", */
@@ -1032,31 +3170,64 @@ static s32 TestSim(simulation_command_line_args CommandLineArgs)
         /* "../assets/listing_0053_add_loop_challenge", */
         "../assets/listing_0054_draw_rectangle",
     };
+    char **FilePaths = DefaultFilePaths;
+    s32 FilePathCount = ARRAY_COUNT(DefaultFilePaths);
+    if (CommandLineArgs.FilePathCount)
+    {
+        FilePaths = CommandLineArgs.FilePaths;
+        FilePathCount = CommandLineArgs.FilePathCount;
+    }
 
-    for (I = 0; I < ARRAY_COUNT(FilePaths); ++I)
+    if (CommandLineArgs.ExpandDumpPath) return ExpandMemoryDump(CommandLineArgs.ExpandDumpPath, CommandLineArgs.ExpandOutputPath);
+    InitSimulatorTables();
+    if (CommandLineArgs.BatchPath) return RunBatch(&CommandLineArgs);
+    if (CommandLineArgs.ScanBenchmarkRepeatCount) return BenchmarkLengthScan(FilePaths, FilePathCount, CommandLineArgs.ScanBenchmarkRepeatCount);
+    if (CommandLineArgs.Mode == simulation_mode_Stream) return StreamDisassembleFiles(FilePaths, FilePathCount, CommandLineArgs.ThreadCount);
+    Context = AllocateSimContext(CommandLineArgs.UseHugePages);
+    if (!Context) return ErrorMessageAndCode("Could not allocate a simulation context\n", 1);
+    for (I = 0; I < FilePathCount; ++I)
     {
-        // Zero out simulation memory between simulations
-        memset(GlobalMemory, 0, GLOBAL_MEMORY_SIZE);
-        buffer *Buffer = ReadFileIntoBuffer(FilePaths[I]);
-        memcpy(GlobalMemory, Buffer->Data, Buffer->Size);
-        // Put a HALT instruction at the end of the program
-        GlobalMemory[Buffer->Size] = HALT_INSTRUCTION;
-        if(!Buffer)
+        mapped_file File;
+        if (MapFile(FilePaths[I], &File))
         {
             printf("Error reading file %s\n", FilePaths[I]);
+            SimResult = 1;
+            continue;
+        }
+        // NOTE: zeroes the memory the last program touched, then loads this one followed by a HALT
+        if (LoadProgram(Context, File.Data, File.Size, CommandLineArgs.LoadSegment, CommandLineArgs.LoadOffset))
+        {
+            printf("Error loading file %s\n", FilePaths[I]);
+            UnmapFile(&File);
+            SimResult = 1;
             continue;
         }
 
         printf("; %s\n", FilePaths[I]);
-        FreeBuffer(Buffer);
-        SimResult = SimulateInstructions(Mode);
+        if (CommandLineArgs.Mode == simulation_mode_Print)
+        {
+            SimResult = DisassembleInstructions(Context->Memory + PhysicalAddress(CommandLineArgs.LoadSegment, CommandLineArgs.LoadOffset), File.Size, CommandLineArgs.ClockModel);
+        }
+        else if (CommandLineArgs.ForkCount)
+        {
+            SimResult = RunSnapshotVariants(Context, &CommandLineArgs);
+        }
+        else if (CommandLineArgs.BenchmarkRepeatCount)
+        {
+            SimResult = BenchmarkInstructions(Context, File.Data, File.Size, CommandLineArgs.BenchmarkRepeatCount, &CommandLineArgs);
+        }
+        else
+        {
+            SimResult = SimulateProgram(Context, &CommandLineArgs, 1);
+        }
+        UnmapFile(&File);
+        if (CommandLineArgs.Mode == simulation_mode_Print) continue;
         if (CommandLineArgs.DumpMemory)
         {
-            FILE *file = fopen("../dist/memory_dump.data", "wb");
-            fwrite(GlobalMemory, 1, GLOBAL_MEMORY_SIZE, file);
-            fclose(file);
+            SimResult = WriteMemoryDump(Context, "../dist/memory_dump.delta");
         }
     }
+    FreeSimContext(Context);
     return SimResult;
 }
 
@@ -1072,6 +3243,8 @@ static s32 StringMatch(char *StringA, char *StringB)
         }
         ++I;
     }
+    // NOTE: one string being a prefix of the other is not a match, otherwise "--jit" would also match "--jit-verify"
+    if (StringA[I] != StringB[I]) Result = 0;
     return Result;
 }
 
@@ -1079,6 +3252,8 @@ static simulation_command_line_args ParseArgs(int ArgCount, char **Args)
 {
     s32 I;
     simulation_command_line_args CommandLineArgs = {0};
+    CommandLineArgs.Mode = simulation_mode_Simulate;
+    CommandLineArgs.FilePaths = Args + 1;
     if (ArgCount > 1)
     {
         for (I = 1; I < ArgCount; ++I)
@@ -1087,14 +3262,111 @@ static simulation_command_line_args ParseArgs(int ArgCount, char **Args)
             {
                 CommandLineArgs.DumpMemory = 1;
             }
+            else if (StringMatch(Args[I], "-p") || StringMatch(Args[I], "--print"))
+            {
+                CommandLineArgs.Mode = simulation_mode_Print;
+            }
+            else if (StringMatch(Args[I], "--stream"))
+            {
+                // NOTE: like --print, but reads the file in chunks instead of loading it, so it takes inputs of any size ("-" is stdin)
+                CommandLineArgs.Mode = simulation_mode_Stream;
+            }
+            else if (StringMatch(Args[I], "-t") || StringMatch(Args[I], "--threaded"))
+            {
+                CommandLineArgs.Core = simulation_core_Threaded;
+            }
+            else if (StringMatch(Args[I], "--blocks"))
+            {
+                CommandLineArgs.Core = simulation_core_Block;
+            }
+            else if (StringMatch(Args[I], "--no-bulk-strings"))
+            {
+                // NOTE: repeated string instructions always run element by element, for comparing against the memcpy/memset path
+                CommandLineArgs.DisableBulkStrings = 1;
+            }
+            else if (StringMatch(Args[I], "--clocks"))
+            {
+                // NOTE: estimates 8086 clocks per instruction, in the trace and as comments on --print lines
+                CommandLineArgs.ClockModel = clock_model_8086;
+            }
+            else if (StringMatch(Args[I], "--8088"))
+            {
+                // NOTE: --clocks for the 8088's 8-bit bus
+                CommandLineArgs.ClockModel = clock_model_8088;
+            }
+            else if (StringMatch(Args[I], "--no-fusion"))
+            {
+                // NOTE: the block core runs every instruction on its own, for comparing against superinstructions
+                CommandLineArgs.DisableFusion = 1;
+            }
+            else if (StringMatch(Args[I], "--jit-verify"))
+            {
+                // NOTE: runs every compiled block through the interpreter as well and compares registers and flags
+                CommandLineArgs.Core = simulation_core_Block;
+                CommandLineArgs.UseJit = 1;
+                CommandLineArgs.VerifyJit = 1;
+            }
+            else if (StringMatch(Args[I], "--jit"))
+            {
+                CommandLineArgs.Core = simulation_core_Block;
+                CommandLineArgs.UseJit = 1;
+            }
+            else if (StringMatch(Args[I], "--batch") && I + 1 < ArgCount)
+            {
+                // NOTE: a manifest with one program path per line, or a directory of programs
+                CommandLineArgs.BatchPath = Args[++I];
+            }
+            else if (StringMatch(Args[I], "--expand-dump") && I + 2 < ArgCount)
+            {
+                CommandLineArgs.ExpandDumpPath = Args[++I];
+                CommandLineArgs.ExpandOutputPath = Args[++I];
+            }
+            else if ((StringMatch(Args[I], "-j") || StringMatch(Args[I], "--threads")) && I + 1 < ArgCount)
+            {
+                CommandLineArgs.ThreadCount = atoi(Args[++I]);
+            }
+            else if (StringMatch(Args[I], "--load-at") && I + 1 < ArgCount)
+            {
+                // NOTE: SEGMENT:OFFSET in hex, programs load at 0000:0000 by default
+                char *Separator;
+                CommandLineArgs.LoadSegment = (u16)strtoul(Args[++I], &Separator, 16);
+                CommandLineArgs.LoadOffset = *Separator == ':' ? (u16)strtoul(Separator + 1, 0, 16) : 0;
+            }
+            else if (StringMatch(Args[I], "--huge-pages"))
+            {
+                CommandLineArgs.UseHugePages = 1;
+            }
+            else if (StringMatch(Args[I], "--fork") && I + 1 < ArgCount)
+            {
+                CommandLineArgs.ForkCount = atoi(Args[++I]);
+            }
+            else if (StringMatch(Args[I], "--bench-scan") && I + 1 < ArgCount)
+            {
+                // NOTE: times the instruction length scans against the decoder on each file, best of N runs
+                CommandLineArgs.ScanBenchmarkRepeatCount = atoi(Args[++I]);
+            }
+            else if ((StringMatch(Args[I], "-b") || StringMatch(Args[I], "--bench")) && I + 1 < ArgCount)
+            {
+                CommandLineArgs.BenchmarkRepeatCount = atoi(Args[++I]);
+            }
+            else
+            {
+                // NOTE: file paths are packed to the front of Args, which never overwrites an argument we have not looked at yet
+                CommandLineArgs.FilePaths[CommandLineArgs.FilePathCount++] = Args[I];
+            }
         }
     }
+    // NOTE: the other cores never look at one instruction on its own, so they cannot say what each one cost
+    if (CommandLineArgs.ClockModel && CommandLineArgs.Core != simulation_core_Loop)
+    {
+        CommandLineArgs.HasInvalidArgs = ErrorMessageAndCode("--clocks and --8088 only run on the loop core, they cannot be combined with -t, --blocks, --jit or --jit-verify\n", 1);
+    }
     return CommandLineArgs;
 }
 
 int main(int ArgCount, char **Args)
 {
     simulation_command_line_args CommandLineArgs = ParseArgs(ArgCount, Args);
-    int Result = TestSim(CommandLineArgs);
+    int Result = CommandLineArgs.HasInvalidArgs ? 1 : TestSim(CommandLineArgs);
     return Result;
 }
@@ -2,16 +2,25 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
 
 typedef uint8_t u8;
 typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
 
 typedef int8_t s8;
 typedef int32_t s32;
 typedef int16_t s16;
+typedef int64_t s64;
 
 typedef size_t size;
 
+typedef double f64;
+
+#include "jit.h"
+
 #define ARRAY_COUNT(a) ((s32)(sizeof(a) / sizeof((a)[0])))
 
 #define GET_FLAG(flags, flag) ((flags & (flag)) || 0)
@@ -29,6 +38,8 @@ typedef enum
    opcode_kind_RegisterToRegisterMemory,
    opcode_kind_Jump,
    opcode_kind_Halt,
+   opcode_kind_String,
+   opcode_kind_FlagControl,
 } opcode_kind;
 
 typedef enum
@@ -41,6 +52,14 @@ typedef enum
     instruction_kind_Sub,
     instruction_kind_Sbb,
     instruction_kind_Cmp,
+    instruction_kind_Movs,
+    instruction_kind_Cmps,
+    instruction_kind_Stos,
+    instruction_kind_Lods,
+    instruction_kind_Scas,
+    instruction_kind_Cld,
+    instruction_kind_Std,
+    instruction_kind_Count,
 } instruction_kind;
 
 typedef struct
@@ -49,6 +68,18 @@ typedef struct
     instruction_kind InstructionKind;
 } opcode;
 
+typedef enum
+{
+    // NOTE: a MOD/REG/RM byte follows the first byte
+    opcode_flag_ModRM = 0x1,
+    // NOTE: bit 1 of the first byte is the D field (the S field for immediate arithmetic)
+    opcode_flag_D = 0x2,
+    // NOTE: bit 0 of the first byte is the W field
+    opcode_flag_W = 0x4,
+    // NOTE: bit 3 of the first byte is the W field and bits 0-2 are the REG field
+    opcode_flag_RegW = 0x8,
+} opcode_flag;
+
 typedef enum
 {
     UNKNOWN_REGISTER,
@@ -87,6 +118,28 @@ typedef enum
     flag_Trap = 0x100,
 } flag;
 
+#define ARITHMETIC_FLAGS (flag_Carry | flag_Parity | flag_Aux_Carry | flag_Zero | flag_Sign | flag_Overflow)
+
+typedef enum
+{
+    lazy_flags_op_None, // the context's Flags already hold every flag
+    lazy_flags_op_Add,
+    lazy_flags_op_Sub,
+} lazy_flags_op;
+
+/* The arithmetic flags of the last add/sub/cmp, kept as the inputs that produced them so the flags
+   themselves are only worked out when something reads them. CarryIn is the incoming carry of
+   adc/sbb and is 0 for everything else. */
+typedef struct
+{
+    lazy_flags_op Op;
+    s32 IsWide;
+    u16 Destination;
+    u16 Source;
+    u16 Result;
+    u16 CarryIn;
+} lazy_flags;
+
 typedef enum
 {
     eac_NONE,
@@ -114,8 +167,29 @@ typedef enum
     eac_DI_D16,
     eac_BP_D16,
     eac_BX_D16,
+    eac_Count,
 } effective_address;
 
+
+// NOTE: in the order of the 8086's sr field, which segment override prefixes (001sr110) use as well
+typedef enum
+{
+    segment_ES,
+    segment_CS,
+    segment_SS,
+    segment_DS,
+    segment_Count,
+} segment;
+
+// NOTE: the registers an effective address adds to its displacement (ADDRESS_NO_REGISTER where it has none) and the segment it uses without an override
+#define ADDRESS_NO_REGISTER -1
+typedef struct
+{
+    s16 Base;
+    s16 Index;
+    segment DefaultSegment;
+} address_form;
+
 typedef enum
 {
   JE     = 0b01110100, // jz
@@ -144,13 +218,172 @@ typedef enum
 {
     simulation_mode_Print,
     simulation_mode_Simulate,
+    // NOTE: disassembles files of any size straight from disk, see StreamDisassembleFile
+    simulation_mode_Stream,
 } simulation_mode;
 
+typedef enum
+{
+    simulation_core_Loop,
+    simulation_core_Threaded,
+    simulation_core_Block,
+} simulation_core;
+
+// NOTE: which bus the clock estimates assume, clock_model_None leaves them off
+typedef enum
+{
+    clock_model_None,
+    clock_model_8086,
+    clock_model_8088,
+} clock_model;
+
 typedef struct
 {
     s32 DumpMemory;
+    s32 UseJit;
+    s32 VerifyJit;
+    s32 BenchmarkRepeatCount;
+    s32 ScanBenchmarkRepeatCount;
+    s32 ForkCount;
+    s32 UseHugePages;
+    s32 DisableFusion;
+    s32 DisableBulkStrings;
+    clock_model ClockModel;
+    s32 HasInvalidArgs;
+    u16 LoadSegment;
+    u16 LoadOffset;
+    simulation_mode Mode;
+    simulation_core Core;
+    char **FilePaths;
+    s32 FilePathCount;
+    char *BatchPath;
+    s32 ThreadCount;
+    char *ExpandDumpPath;
+    char *ExpandOutputPath;
 } simulation_command_line_args;
 
+#include "batch.h"
+#include "stream.h"
+
+typedef struct decoded_instruction decoded_instruction;
+typedef struct sim_context sim_context;
+typedef struct sim_snapshot sim_snapshot;
+typedef s32 simulate_handler(sim_context *Context, decoded_instruction *Instruction);
+
+/*
+  Every instruction form the simulator can execute. The decoder resolves each instruction to one of
+  these, which both indexes SimulateHandlerTable and picks the label in the threaded core.
+*/
+typedef enum
+{
+    simulate_op_None,
+    simulate_op_RegisterToRegister,
+    simulate_op_MoveToSegmentRegister,
+    simulate_op_RegisterAndEffectiveAddress,
+    simulate_op_ImmediateToRegisterMemory,
+    simulate_op_ImmediateToEffectiveAddress,
+    simulate_op_ImmediateToRegister,
+    simulate_op_MemoryAccumulator,
+    simulate_op_Jump,
+    simulate_op_Loop,
+    simulate_op_Halt,
+    simulate_op_String,
+    simulate_op_FlagControl,
+    simulate_op_Count,
+} simulate_op;
+
+/*
+  One entry per possible first byte. The decoder reads the static decode metadata from here and
+  picks the handler, so the simulate loop only has to make one indirect call per instruction.
+*/
+typedef struct
+{
+    opcode Opcode;
+    u8 Flags;
+    simulate_op Op;
+    // NOTE: used instead of Op when the MOD field selects a memory operand
+    simulate_op MemoryOp;
+} opcode_dispatch;
+
+/*
+  A fully decoded instruction. Everything the simulator needs to run (or print) the instruction
+  is pulled out of the instruction bytes once, so executing the same bytes again does not need to
+  touch memory or re-run the bit extraction.
+*/
+struct decoded_instruction
+{
+    simulate_handler *Simulate;
+    simulate_op Op;
+    opcode Opcode;
+    u8 FirstByte;
+    u8 Length;
+    u8 MOD;
+    u8 D;
+    u8 W;
+    u8 IsMove;
+    u8 IsWideData;
+    u8 IsWideDisplacement;
+    u8 IsDirectAddress;
+    // NOTE: the segment of the memory operand, DS or SS for BP based addresses unless a prefix overrides it
+    u8 Segment;
+    u8 HasSegmentOverride;
+    // NOTE: REP_PREFIX, REPNE_PREFIX or zero; only string instructions look at it
+    u8 RepeatPrefix;
+    // NOTE: the memory operand's offset is (Registers[AddressBase] & AddressBaseMask) + (Registers[AddressIndex] & AddressIndexMask) + Displacement
+    u8 AddressBase;
+    u8 AddressIndex;
+    u16 AddressBaseMask;
+    u16 AddressIndexMask;
+    s16 DestinationRegister;
+    s16 SourceRegister;
+    effective_address EffectiveAddress;
+    s16 Displacement;
+    s16 Immediate;
+    // NOTE: set in translated blocks only, when Simulate is a superinstruction that runs this and the next FusedCount - 1 instructions
+    u8 FusedCount;
+};
+
+typedef struct
+{
+    u64 Hits;
+    u64 Misses;
+    u64 Invalidations;
+} decode_cache_stats;
+
+/*
+  The estimated clocks of one instruction, split the way the manual's timing tables split them: the
+  clocks of the instruction form, the effective address calculation and the word transfer penalty.
+*/
+typedef struct
+{
+    u32 Base;
+    u32 EffectiveAddress;
+    u32 Penalty;
+} instruction_clocks;
+
+// NOTE: the machine state a clock estimate needs from before the instruction ran
+typedef struct
+{
+    u16 Count;
+    u16 Offset;
+    u16 SourceIndex;
+    u16 DestinationIndex;
+} clock_sample;
+
+// NOTE: the operand forms of the mov and arithmetic timing tables, "Register" is the destination when it comes first
+typedef enum
+{
+    clock_form_RegisterRegister,
+    clock_form_RegisterMemory,
+    clock_form_MemoryRegister,
+    clock_form_RegisterImmediate,
+    clock_form_MemoryImmediate,
+    clock_form_AccumulatorImmediate,
+    clock_form_AccumulatorMemory,
+    clock_form_MemoryAccumulator,
+    clock_form_Count,
+} clock_form;
+
 static char *DisplayOpcodeKind(opcode_kind Kind)
 {
     switch(Kind)
@@ -163,6 +396,8 @@ static char *DisplayOpcodeKind(opcode_kind Kind)
     case opcode_kind_RegisterToRegisterMemory: return "opcode_kind_RegisterToRegisterMemory";
     case opcode_kind_Halt: return "opcode_kind_Halt";
     case opcode_kind_Jump: return "opcode_kind_Jump";
+    case opcode_kind_String: return "opcode_kind_String";
+    case opcode_kind_FlagControl: return "opcode_kind_FlagControl";
     case opcode_kind_None: default: return "opcode_kind_None";
     }
 }
@@ -207,6 +442,13 @@ static char *DisplayInstructionKind(instruction_kind Kind)
     case instruction_kind_Sub: return "sub";
     case instruction_kind_Sbb: return "sbb";
     case instruction_kind_Cmp: return "cmp";
+    case instruction_kind_Movs: return "movs";
+    case instruction_kind_Cmps: return "cmps";
+    case instruction_kind_Stos: return "stos";
+    case instruction_kind_Lods: return "lods";
+    case instruction_kind_Scas: return "scas";
+    case instruction_kind_Cld: return "cld";
+    case instruction_kind_Std: return "std";
 
     default: return "UNKNOWN INSTRUCTION KIND";
     }
@@ -217,13 +459,51 @@ static char *DisplayByteSize(s32 IsWide)
     return IsWide ? "word" : "byte";
 }
 
-static void DEBUG_PrintByteInBinary(u8 Byte)
+/*
+  A basic block: the decoded instructions from StartIP up to and including the first jump or HLT.
+  Instructions points into the shared block instruction pool.
+*/
+typedef struct
 {
-    s32 I;
-    printf(" ");
-    for (I = 7; I >= 0; --I)
-    {
-        printf("%d", (Byte >> I) & 0b1);
-    };
-    printf(" ");
-}
+    u16 StartIP;
+    u16 ByteLength;
+    s32 InstructionCount;
+    s32 IsValid;
+    decoded_instruction *Instructions;
+    u32 ExecutionCount;
+    jit_state JitState;
+    jit_block_function *JitFunction;
+} translated_block;
+
+// NOTE: the instruction sequences the block translator fuses into superinstructions, see FuseBlockInstructions
+typedef enum
+{
+    fusion_None,
+    fusion_ArithmeticCompareJump,
+    fusion_ArithmeticJump,
+    fusion_RegisterLoop,
+    fusion_MoveArithmetic,
+    fusion_Count,
+} fusion_kind;
+
+typedef struct
+{
+    u64 Sites[fusion_Count];
+    u64 Executions[fusion_Count];
+} fusion_stats;
+
+typedef struct
+{
+    u64 BlocksTranslated;
+    u64 InstructionsTranslated;
+    u64 BlocksExecuted;
+    u64 Invalidations;
+    u64 Flushes;
+} block_cache_stats;
+
+// NOTE: a display string and its length, so the disassembler can copy it without a strlen
+typedef struct
+{
+    char *Data;
+    s32 Length;
+} display_text;
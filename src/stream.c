@@ -0,0 +1,248 @@
+/*
+  Streaming disassembly
+  =====================
+  A linear sweep over a file of any size that never loads it into guest memory. Every path below
+  advances with SweepInstruction, so they all produce the same text for the same bytes.
+
+  The serial sweep reads the file into a STREAM_WINDOW_SIZE window; once fewer than
+  MAX_INSTRUCTION_LENGTH bytes are left past the decode position, the tail is moved to the front and
+  the window refilled behind it, so an instruction that straddles two reads is decoded whole. The
+  window stays below 64K, which keeps decode positions in the decoder's 16-bit IP.
+
+  The parallel sweep works through a regular file in rounds of one PARALLEL_CHUNK_SIZE chunk per
+  thread, which bounds its memory whatever the file size. Each thread sweeps its chunk from the first
+  byte, whether or not an instruction starts there. Stitching walks the chunks in order: the true
+  sweep leaves the previous chunk at some byte at or past its end, and is carried on one instruction
+  at a time until it lands on a byte the chunk's own sweep also started an instruction at. Workers
+  find their instructions with the length scan (scan.c) rather than the decoder, and mark them in a
+  boundary bitmap that stitching tests against. From there
+  the two sweeps decode the same instructions, so the rest of the chunk's text is copied as is. 8086
+  code falls back into step within a few instructions, so almost nothing is decoded twice.
+*/
+#define STREAM_WINDOW_SIZE (32 * 1024)
+#define PARALLEL_CHUNK_SIZE (1024 * 1024)
+
+/*
+  Formats the instruction at Bytes and returns its length. Bytes that do not decode to something this
+  disassembler can print, and an instruction cut off by the end of the input (Remaining bytes are
+  left), are written as one "db" line for the first byte. Bytes must be readable for
+  MAX_INSTRUCTION_LENGTH bytes, zeroed past the end of the input. GetSweepLength gives the same
+  length without the text.
+*/
+static s32 SweepInstruction(output_writer *Writer, u8 *Bytes, u64 Remaining)
+{
+    decoded_instruction Instruction;
+    if (DecodeSweepInstruction(Bytes, Remaining, &Instruction))
+    {
+        // NOTE: PrintInstruction only fails for opcode kinds IsKnownOpcode already turned away
+        PrintInstruction(Writer, &Instruction);
+        return Instruction.Length;
+    }
+    ReserveOutput(Writer, MAX_INSTRUCTION_TEXT);
+    WriteBytes(Writer, "db ", 3);
+    WriteDecimal(Writer, Bytes[0]);
+    WriteChar(Writer, '\n');
+    return 1;
+}
+
+// NOTE: a comment, so the listing still reassembles
+static void PrintStreamReport(u64 ByteCount, s32 ThreadCount, u64 ResyncByteCount, f64 ElapsedSeconds)
+{
+    printf("; Stream: %llu bytes, %d threads, %llu bytes resynced, %.3f seconds, %.1f MB/s\n",
+           (unsigned long long)ByteCount, ThreadCount, (unsigned long long)ResyncByteCount, ElapsedSeconds,
+           ElapsedSeconds > 0 ? (f64)ByteCount / ElapsedSeconds / 1000000.0 : 0.0);
+}
+
+static s32 StreamDisassembleFile(s32 File)
+{
+    s32 Result = 0, Used = 0, Position = 0, IsAtEnd = 0;
+    u64 ByteCount = 0;
+    f64 StartSeconds = GetWallClockSeconds();
+    output_writer Writer;
+    // NOTE: zeroed padding past the window, so the decoder never reads past the allocation at the end of the file
+    u8 *Window = calloc(1, STREAM_WINDOW_SIZE + MAX_INSTRUCTION_LENGTH);
+    if (!Window) return ErrorMessageAndCode("Could not allocate the stream window\n", 1);
+    if (InitOutputWriter(&Writer, STDOUT_FILENO))
+    {
+        free(Window);
+        return 1;
+    }
+    WriteBytes(&Writer, "bits 16\n", 8);
+    for (;;)
+    {
+        if (!IsAtEnd && Used - Position < MAX_INSTRUCTION_LENGTH)
+        {
+            s64 ReadCount;
+            memmove(Window, Window + Position, Used - Position);
+            Used -= Position;
+            Position = 0;
+            ReadCount = ReadFileBytes(File, Window + Used, STREAM_WINDOW_SIZE - Used);
+            if (ReadCount < 0)
+            {
+                Result = 1;
+                break;
+            }
+            IsAtEnd = ReadCount < STREAM_WINDOW_SIZE - Used;
+            Used += (s32)ReadCount;
+            ByteCount += ReadCount;
+            memset(Window + Used, 0, MAX_INSTRUCTION_LENGTH);
+        }
+        if (Position == Used) break;
+        Position += SweepInstruction(&Writer, Window + Position, Used - Position);
+    }
+    if (FreeOutputWriter(&Writer) && !Result) Result = 1;
+    free(Window);
+    if (Result) return ErrorMessageAndCode("Streaming disassembly failed\n", Result);
+    PrintStreamReport(ByteCount, 1, 0, GetWallClockSeconds() - StartSeconds);
+    return 0;
+}
+
+static void *DisassembleChunkMain(void *Parameter)
+{
+    disassembly_chunk *Chunk = Parameter;
+    u64 ChunkSize = Chunk->End - Chunk->Start, Offset;
+    s32 InstructionIndex;
+    u64 InputSize = Chunk->FileSize - Chunk->Start;
+    s64 ReadCount;
+    if (InputSize > ChunkSize + MAX_INSTRUCTION_LENGTH) InputSize = ChunkSize + MAX_INSTRUCTION_LENGTH;
+    ReadCount = ReadFileBytesAt(Chunk->File, Chunk->Input, InputSize, Chunk->Start);
+    if (ReadCount != (s64)InputSize)
+    {
+        Chunk->Result = 1;
+        return 0;
+    }
+    memset(Chunk->Input + InputSize, 0, ChunkSize + MAX_INSTRUCTION_LENGTH - InputSize);
+    ScanInstructionLengths(BestLengthScan, Chunk->Input, (s32)ChunkSize, Chunk->FileSize - Chunk->Start, Chunk->Lengths);
+    Chunk->EndPosition = Chunk->Start + MarkInstructionStarts(Chunk->Lengths, (s32)ChunkSize, 0, Chunk->Starts);
+    Chunk->Text.Used = 0;
+    for (Offset = 0, InstructionIndex = 0; Offset < ChunkSize; Offset += Chunk->Lengths[Offset])
+    {
+        Chunk->TextOffsets[InstructionIndex++] = Chunk->Text.Used;
+        SweepInstruction(&Chunk->Text, Chunk->Input + Offset, Chunk->FileSize - Chunk->Start - Offset);
+    }
+    Chunk->Result = Chunk->Text.HasFailed;
+    return 0;
+}
+
+static void FreeDisassemblyChunks(disassembly_chunk *Chunks, s32 ChunkCount)
+{
+    s32 I;
+    for (I = 0; I < ChunkCount; ++I)
+    {
+        free(Chunks[I].Input);
+        free(Chunks[I].Lengths);
+        free(Chunks[I].Starts);
+        free(Chunks[I].TextOffsets);
+        free(Chunks[I].Text.Data);
+    }
+    free(Chunks);
+}
+
+static s32 ParallelDisassembleFile(s32 File, u64 FileSize, s32 ThreadCount)
+{
+    s32 I, Result = 0, ChunkCount = ThreadCount;
+    u64 RoundStart, Position = 0, ResyncByteCount = 0;
+    f64 StartSeconds = GetWallClockSeconds();
+    output_writer Writer;
+    disassembly_chunk *Chunks = calloc(ChunkCount, sizeof(disassembly_chunk));
+    if (!Chunks) return ErrorMessageAndCode("Could not allocate the disassembly chunks\n", 1);
+    for (I = 0; I < ChunkCount; ++I)
+    {
+        Chunks[I].Input = malloc(PARALLEL_CHUNK_SIZE + MAX_INSTRUCTION_LENGTH);
+        Chunks[I].Lengths = malloc(PARALLEL_CHUNK_SIZE);
+        Chunks[I].Starts = malloc((PARALLEL_CHUNK_SIZE + 63) / 64 * sizeof(u64));
+        Chunks[I].TextOffsets = malloc(PARALLEL_CHUNK_SIZE * sizeof(u32));
+        if (!Chunks[I].Input || !Chunks[I].Lengths || !Chunks[I].Starts || !Chunks[I].TextOffsets || InitOutputWriter(&Chunks[I].Text, OUTPUT_TO_MEMORY))
+        {
+            FreeDisassemblyChunks(Chunks, ChunkCount);
+            return ErrorMessageAndCode("Could not allocate the disassembly chunks\n", 1);
+        }
+        Chunks[I].File = File;
+        Chunks[I].FileSize = FileSize;
+    }
+    if (InitOutputWriter(&Writer, STDOUT_FILENO))
+    {
+        FreeDisassemblyChunks(Chunks, ChunkCount);
+        return 1;
+    }
+    WriteBytes(&Writer, "bits 16\n", 8);
+
+    for (RoundStart = 0; RoundStart < FileSize && !Result; RoundStart += (u64)ChunkCount * PARALLEL_CHUNK_SIZE)
+    {
+        s32 RoundChunkCount = 0;
+        for (I = 0; I < ChunkCount && RoundStart + (u64)I * PARALLEL_CHUNK_SIZE < FileSize; ++I)
+        {
+            disassembly_chunk *Chunk = &Chunks[I];
+            Chunk->Start = RoundStart + (u64)I * PARALLEL_CHUNK_SIZE;
+            Chunk->End = Chunk->Start + PARALLEL_CHUNK_SIZE < FileSize ? Chunk->Start + PARALLEL_CHUNK_SIZE : FileSize;
+            Chunk->Result = 0;
+            RoundChunkCount += 1;
+        }
+        for (I = 0; I < RoundChunkCount; ++I)
+        {
+            Chunks[I].IsRunning = !pthread_create(&Chunks[I].Thread, 0, DisassembleChunkMain, &Chunks[I]);
+            // NOTE: a chunk whose thread did not start is swept on this one
+            if (!Chunks[I].IsRunning) DisassembleChunkMain(&Chunks[I]);
+        }
+        for (I = 0; I < RoundChunkCount; ++I)
+        {
+            if (Chunks[I].IsRunning) pthread_join(Chunks[I].Thread, 0);
+        }
+        for (I = 0; I < RoundChunkCount; ++I)
+        {
+            disassembly_chunk *Chunk = &Chunks[I];
+            if (Chunk->Result)
+            {
+                Result = 1;
+                break;
+            }
+            // NOTE: Position is where the true sweep left the previous chunk, carry it on until the two sweeps agree
+            while (Position < Chunk->End && !IsInstructionStart(Chunk->Starts, (s32)(Position - Chunk->Start)))
+            {
+                s32 Length = SweepInstruction(&Writer, Chunk->Input + (Position - Chunk->Start), FileSize - Position);
+                Position += Length;
+                ResyncByteCount += Length;
+            }
+            if (Position < Chunk->End)
+            {
+                u32 TextOffset = Chunk->TextOffsets[CountInstructionStarts(Chunk->Starts, (s32)(Position - Chunk->Start))];
+                WriteOutputBytes(&Writer, Chunk->Text.Data + TextOffset, Chunk->Text.Used - TextOffset);
+                Position = Chunk->EndPosition;
+            }
+        }
+    }
+
+    if (FreeOutputWriter(&Writer) && !Result) Result = 1;
+    FreeDisassemblyChunks(Chunks, ChunkCount);
+    if (Result) return ErrorMessageAndCode("Parallel disassembly failed\n", Result);
+    PrintStreamReport(FileSize, ThreadCount, ResyncByteCount, GetWallClockSeconds() - StartSeconds);
+    return 0;
+}
+
+// NOTE: "-" is stdin. Regular files are swept in parallel unless ThreadCount is 1, everything else through the serial window
+static s32 StreamDisassembleFiles(char **FilePaths, s32 FilePathCount, s32 ThreadCount)
+{
+    s32 I, Result = 0;
+    if (ThreadCount <= 0) ThreadCount = GetProcessorCount();
+    for (I = 0; I < FilePathCount; ++I)
+    {
+        char *FilePath = FilePaths[I];
+        s32 IsStandardInput = FilePath[0] == '-' && !FilePath[1];
+        s32 File = IsStandardInput ? STDIN_FILENO : open(FilePath, O_RDONLY);
+        u64 FileSize;
+        printf("; %s\n", FilePath);
+        if (File < 0)
+        {
+            printf("Could not open %s for streaming\n", FilePath);
+            Result = 1;
+            continue;
+        }
+        if (ThreadCount > 1 && !GetRegularFileSize(File, &FileSize))
+        {
+            if (ParallelDisassembleFile(File, FileSize, ThreadCount)) Result = 1;
+        }
+        else if (StreamDisassembleFile(File)) Result = 1;
+        if (!IsStandardInput) close(File);
+    }
+    return Result;
+}
@@ -0,0 +1,48 @@
+/*
+  Disassembly text is formatted straight into Data and handed to the operating system one large write
+  at a time, see FlushOutputWriter.
+*/
+typedef struct
+{
+    char *Data;
+    s32 Size;
+    s32 Used;
+    s32 File;
+    s32 HasFailed;
+} output_writer;
+
+// NOTE: the ways ScanInstructionLengths can run, the SIMD ones only where the CPU supports them
+typedef enum
+{
+    length_scan_Scalar,
+    length_scan_Sse4,
+    length_scan_Avx2,
+    length_scan_Count,
+} length_scan_kind;
+
+/*
+  One slice [Start, End) of a file for the parallel disassembler. A worker sweeps the slice from Start
+  as if an instruction began there, marks the bytes it started an instruction at in Starts, formats
+  it into Text and records where each instruction's line begins in Text.
+*/
+typedef struct
+{
+    s32 File;
+    u64 FileSize;
+    u64 Start;
+    u64 End;
+    // NOTE: End - Start bytes of the file plus MAX_INSTRUCTION_LENGTH read ahead, zeroed past the end of the file
+    u8 *Input;
+    // NOTE: the sweep length at every byte of the slice, see ScanInstructionLengths
+    u8 *Lengths;
+    // NOTE: a bit per byte of the slice, see MarkInstructionStarts
+    u64 *Starts;
+    // NOTE: indexed by instruction, in sweep order
+    u32 *TextOffsets;
+    output_writer Text;
+    // NOTE: the first byte after the last instruction of the sweep, at or past End
+    u64 EndPosition;
+    s32 Result;
+    pthread_t Thread;
+    s32 IsRunning;
+} disassembly_chunk;